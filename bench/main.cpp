@@ -0,0 +1,533 @@
+#include <database.hpp>
+#include <faker.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+// Usage: uva-database-bench [--rows 1000,10000] [--threads 1,4] [--seed 42] [--output results.json]
+//
+// Every workload runs twice: through the ORM and through a hand-written sqlite3 equivalent
+// on the same data, so the report shows how much of the time is spent by this library.
+
+class BenchItem : public uva::database::basic_active_record
+{
+    uva_database_declare(BenchItem);
+};
+
+uva_database_define(BenchItem);
+
+class AddBenchItemsMigration : public uva::database::basic_migration
+{
+uva_declare_migration(AddBenchItemsMigration);
+protected:
+    virtual void change() override
+    {
+        add_table("bench_items",
+        {
+            { "id",         "INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL" },
+            { "name",       "TEXT NOT NULL" },
+            { "price",      "REAL NOT NULL" },
+            { "quantity",   "INTEGER NOT NULL" },
+            { "updated_at", "INTEGER NOT NULL DEFAULT (STRFTIME('%s'))" },
+            { "created_at", "INTEGER NOT NULL DEFAULT (STRFTIME('%s'))" },
+            { "removed",    "INTEGER NOT NULL DEFAULT 0" },
+        });
+    }
+};
+
+uva_define_migration(AddBenchItemsMigration);
+
+struct bench_options
+{
+    std::vector<size_t> rows = { 1000, 10000 };
+    std::vector<size_t> threads = { 1 };
+    unsigned seed = 42;
+    std::filesystem::path output;
+};
+
+struct bench_result
+{
+    std::string workload;
+    size_t rows = 0;
+    size_t threads = 0;
+    size_t operations = 0;
+    std::chrono::nanoseconds wall = std::chrono::nanoseconds::zero();
+    // Latency of every operation, sorted.
+    std::vector<std::chrono::nanoseconds> latencies;
+
+    std::chrono::nanoseconds percentile(double p) const
+    {
+        if(latencies.empty()) {
+            return std::chrono::nanoseconds::zero();
+        }
+
+        size_t index = std::min(latencies.size() - 1, (size_t)(p / 100.0 * latencies.size()));
+        return latencies[index];
+    }
+};
+
+// The ORM run of a workload next to its raw sqlite3 run.
+struct paired_result
+{
+    bench_result orm;
+    bench_result raw;
+
+    // How many times slower the ORM is than raw sqlite3.
+    double overhead() const
+    {
+        return raw.wall.count() ? (double)orm.wall.count() / (double)raw.wall.count() : 0.0;
+    }
+};
+
+using operation = std::function<void(size_t thread, size_t index)>;
+
+// A workload runs operation(thread, index) for every index of its share of the rows.
+struct workload
+{
+    std::string name;
+    // Workloads sharing the connection transaction can't run on several threads.
+    bool concurrent = true;
+    operation orm;
+    // The same operation written directly against the sqlite3 C API.
+    operation raw;
+    // Number of operations for a dataset of the given rows, defaults to rows.
+    std::function<size_t(size_t rows)> operations;
+};
+
+// The dataset as a hand-written data layer would keep it, used by the raw operations.
+struct raw_row
+{
+    std::string name;
+    double price;
+    int64_t quantity;
+};
+
+static std::vector<size_t> parse_list(const std::string& value)
+{
+    std::vector<size_t> values;
+    std::stringstream stream(value);
+    std::string item;
+
+    while(std::getline(stream, item, ',')) {
+        values.push_back(std::stoull(item));
+    }
+
+    return values;
+}
+
+static bench_options parse_options(int argc, char** argv)
+{
+    bench_options options;
+
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+
+        if(arg == "--rows") {
+            options.rows = parse_list(value);
+        } else if(arg == "--threads") {
+            options.threads = parse_list(value);
+        } else if(arg == "--seed") {
+            options.seed = (unsigned)std::stoul(value);
+        } else if(arg == "--output") {
+            options.output = value;
+        } else {
+            throw std::runtime_error(std::format("unknown option {}", arg));
+        }
+    }
+
+    return options;
+}
+
+// Rows are generated once per dataset size so every workload and thread count sees the same data.
+static void make_rows(size_t count, unsigned seed, std::vector<std::map<std::string, var>>& rows, std::vector<raw_row>& raw_rows)
+{
+    std::srand(seed);
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> price(1.0, 1000.0);
+    std::uniform_int_distribution<int> quantity(0, 100);
+
+    rows.clear();
+    rows.reserve(count);
+    raw_rows.clear();
+    raw_rows.reserve(count);
+
+    for(size_t i = 0; i < count; ++i) {
+        raw_row row = { uva::faker::commerce::product(), price(random), quantity(random) };
+
+        rows.push_back({
+            { "name",     row.name },
+            { "price",    row.price },
+            { "quantity", row.quantity },
+        });
+
+        raw_rows.push_back(std::move(row));
+    }
+}
+
+static sqlite3* raw_database()
+{
+    return ((uva::database::sqlite3_connection*)uva::database::basic_connection::get_connection())->get_database();
+}
+
+// Statements are prepared once per thread and reset after use, as a hand-written data layer would.
+static sqlite3_stmt* raw_statement(const char* sql)
+{
+    struct statements
+    {
+        std::unordered_map<std::string, sqlite3_stmt*> cache;
+
+        ~statements()
+        {
+            for(auto& statement : cache) {
+                sqlite3_finalize(statement.second);
+            }
+        }
+    };
+
+    thread_local statements statements;
+
+    sqlite3_stmt*& stmt = statements.cache[sql];
+
+    if(!stmt && sqlite3_prepare_v2(raw_database(), sql, -1, &stmt, nullptr)) {
+        throw std::runtime_error(sqlite3_errmsg(raw_database()));
+    }
+
+    return stmt;
+}
+
+static void raw_done(sqlite3_stmt* stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+static void raw_exec(const char* sql)
+{
+    sqlite3_stmt* stmt = raw_statement(sql);
+    sqlite3_step(stmt);
+    raw_done(stmt);
+}
+
+// Reads every column of the current row, copying text like the ORM does into its values.
+static void raw_read_row(sqlite3_stmt* stmt)
+{
+    for(int column = 0; column < sqlite3_column_count(stmt); ++column) {
+        switch(sqlite3_column_type(stmt, column))
+        {
+            case SQLITE_INTEGER:
+                sqlite3_column_int64(stmt, column);
+            break;
+            case SQLITE_FLOAT:
+                sqlite3_column_double(stmt, column);
+            break;
+            case SQLITE_TEXT:
+            case SQLITE_BLOB:
+                std::string((const char*)sqlite3_column_text(stmt, column), sqlite3_column_bytes(stmt, column));
+            break;
+        }
+    }
+}
+
+static void raw_insert(const raw_row& row)
+{
+    sqlite3_stmt* stmt = raw_statement("INSERT INTO bench_items(name, price, quantity) VALUES(?, ?, ?);");
+
+    sqlite3_bind_text(stmt, 1, row.name.c_str(), (int)row.name.size(), SQLITE_STATIC);
+    sqlite3_bind_double(stmt, 2, row.price);
+    sqlite3_bind_int64(stmt, 3, row.quantity);
+
+    if(sqlite3_step(stmt) != SQLITE_DONE) {
+        throw std::runtime_error(sqlite3_errmsg(raw_database()));
+    }
+
+    raw_done(stmt);
+}
+
+// Also resets AUTOINCREMENT, so ids always go from 1 to the number of rows.
+static void clear_table()
+{
+    uva::database::active_record_relation().commit_without_prepare("DELETE FROM bench_items;");
+    uva::database::active_record_relation().commit_without_prepare("DELETE FROM sqlite_sequence WHERE name = 'bench_items';");
+}
+
+static void fill_table(std::vector<std::map<std::string, var>> rows)
+{
+    clear_table();
+
+    uva::database::within_transaction([&] {
+        BenchItem::create(rows);
+    });
+}
+
+static bench_result run(const workload& w, const operation& op, size_t rows, size_t threads)
+{
+    bench_result result;
+    result.workload = w.name;
+    result.rows = rows;
+    result.threads = w.concurrent ? threads : 1;
+    result.operations = w.operations ? w.operations(rows) : rows;
+
+    std::vector<std::vector<std::chrono::nanoseconds>> latencies(result.threads);
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+
+    for(size_t thread = 0; thread < result.threads; ++thread) {
+        workers.emplace_back([&, thread] {
+            std::vector<std::chrono::nanoseconds>& thread_latencies = latencies[thread];
+
+            for(size_t index = thread; index < result.operations; index += result.threads) {
+                auto operation_start = std::chrono::steady_clock::now();
+                op(thread, index);
+                thread_latencies.push_back(std::chrono::steady_clock::now() - operation_start);
+            }
+        });
+    }
+
+    for(std::thread& worker : workers) {
+        worker.join();
+    }
+
+    result.wall = std::chrono::steady_clock::now() - start;
+
+    for(auto& thread_latencies : latencies) {
+        result.latencies.insert(result.latencies.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    return result;
+}
+
+static std::string timings_json(const bench_result& result)
+{
+    auto to_us = [](std::chrono::nanoseconds duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    double seconds = std::chrono::duration<double>(result.wall).count();
+    std::chrono::nanoseconds total = std::accumulate(result.latencies.begin(), result.latencies.end(), std::chrono::nanoseconds::zero());
+    std::chrono::nanoseconds mean = result.latencies.empty() ? total : total / (int64_t)result.latencies.size();
+
+    return std::format("{{ \"wall_ms\": {:.3f}, \"ops_per_sec\": {:.1f}, \"mean_us\": {:.3f}, \"p50_us\": {:.3f}, \"p95_us\": {:.3f}, \"p99_us\": {:.3f} }}",
+        seconds * 1000.0, seconds > 0 ? result.operations / seconds : 0.0,
+        to_us(mean), to_us(result.percentile(50)), to_us(result.percentile(95)), to_us(result.percentile(99)));
+}
+
+static void write_json(std::ostream& stream, const bench_options& options, const std::vector<paired_result>& results)
+{
+    stream << std::format("{{\n  \"seed\": {},\n  \"results\": [\n", options.seed);
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        const paired_result& result = results[i];
+
+        stream << std::format("    {{ \"workload\": \"{}\", \"rows\": {}, \"threads\": {}, \"operations\": {}, \"orm\": {}, \"raw\": {}, \"overhead\": {:.3f} }}",
+            result.orm.workload, result.orm.rows, result.orm.threads, result.orm.operations, timings_json(result.orm), timings_json(result.raw), result.overhead());
+
+        stream << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+
+    stream << "  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    bench_options options = parse_options(argc, argv);
+
+    std::filesystem::path db_path = std::filesystem::temp_directory_path() / "uva-database-bench.db";
+
+    if(std::filesystem::exists(db_path)) {
+        std::filesystem::remove(db_path);
+    }
+
+    uva::database::enable_query_cout_printing = false;
+
+    uva_database_define_sqlite3(db_path);
+    uva_run_migrations();
+
+    std::vector<paired_result> results;
+
+    std::vector<std::map<std::string, var>> dataset;
+    std::vector<raw_row> raw_dataset;
+
+    for(size_t rows : options.rows) {
+        make_rows(rows, options.seed, dataset, raw_dataset);
+        // Transaction batches commit every batch_size inserts.
+        static constexpr size_t batch_size = 100;
+
+        // Bulk loads the whole dataset, find/where/count/each/update work on it.
+        std::vector<workload> workloads = {
+            {
+                .name = "insert_single",
+                .orm = [&](size_t, size_t index) {
+                    BenchItem item(dataset[index]);
+                    item.save();
+                },
+                .raw = [&](size_t, size_t index) {
+                    raw_insert(raw_dataset[index]);
+                },
+            },
+            {
+                .name = "insert_bulk",
+                .concurrent = false,
+                .orm = [&](size_t, size_t) {
+                    fill_table(dataset);
+                },
+                .raw = [&](size_t, size_t) {
+                    clear_table();
+                    raw_exec("BEGIN;");
+                    for(const raw_row& row : raw_dataset) {
+                        raw_insert(row);
+                    }
+                    raw_exec("COMMIT;");
+                },
+                .operations = [](size_t) { return (size_t)1; },
+            },
+            {
+                .name = "find_by_id",
+                .orm = [&](size_t, size_t index) {
+                    BenchItem::find_by("id = {}", index + 1);
+                },
+                .raw = [&](size_t, size_t index) {
+                    sqlite3_stmt* stmt = raw_statement("SELECT * FROM bench_items WHERE id = ? AND removed = 0 ORDER BY id LIMIT 1;");
+                    sqlite3_bind_int64(stmt, 1, (int64_t)index + 1);
+                    if(sqlite3_step(stmt) == SQLITE_ROW) {
+                        raw_read_row(stmt);
+                    }
+                    raw_done(stmt);
+                },
+            },
+            {
+                .name = "where_pluck",
+                .orm = [&](size_t, size_t index) {
+                    BenchItem::where("quantity = {}", index % 100).pluck("name");
+                },
+                .raw = [&](size_t, size_t index) {
+                    sqlite3_stmt* stmt = raw_statement("SELECT name FROM bench_items WHERE quantity = ? AND removed = 0;");
+                    sqlite3_bind_int64(stmt, 1, (int64_t)(index % 100));
+                    std::vector<std::string> names;
+                    while(sqlite3_step(stmt) == SQLITE_ROW) {
+                        names.emplace_back((const char*)sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
+                    }
+                    raw_done(stmt);
+                },
+                .operations = [](size_t rows) { return std::max<size_t>(1, rows / 100); },
+            },
+            {
+                .name = "count",
+                .orm = [&](size_t, size_t index) {
+                    BenchItem::where("price > {}", (double)(index % 1000)).count();
+                },
+                .raw = [&](size_t, size_t index) {
+                    sqlite3_stmt* stmt = raw_statement("SELECT COUNT(*) FROM bench_items WHERE price > ? AND removed = 0;");
+                    sqlite3_bind_double(stmt, 1, (double)(index % 1000));
+                    sqlite3_step(stmt);
+                    sqlite3_column_int64(stmt, 0);
+                    raw_done(stmt);
+                },
+                .operations = [](size_t rows) { return std::max<size_t>(1, rows / 100); },
+            },
+            {
+                .name = "each",
+                .concurrent = false,
+                .orm = [&](size_t, size_t) {
+                    BenchItem::each([](BenchItem& item) { });
+                },
+                .raw = [&](size_t, size_t) {
+                    sqlite3_stmt* stmt = raw_statement("SELECT * FROM bench_items WHERE removed = 0 ORDER BY id;");
+                    while(sqlite3_step(stmt) == SQLITE_ROW) {
+                        raw_read_row(stmt);
+                    }
+                    raw_done(stmt);
+                },
+                .operations = [](size_t) { return (size_t)1; },
+            },
+            {
+                .name = "update",
+                .orm = [&](size_t, size_t index) {
+                    BenchItem::where("id = {}", index + 1).update({ { "quantity", (int64_t)index } });
+                },
+                .raw = [&](size_t, size_t index) {
+                    sqlite3_stmt* stmt = raw_statement("UPDATE bench_items SET quantity = ? WHERE id = ? AND removed = 0;");
+                    sqlite3_bind_int64(stmt, 1, (int64_t)index);
+                    sqlite3_bind_int64(stmt, 2, (int64_t)index + 1);
+                    sqlite3_step(stmt);
+                    raw_done(stmt);
+                },
+            },
+            {
+                .name = "transaction_batches",
+                .concurrent = false,
+                .orm = [&](size_t, size_t batch) {
+                    uva::database::within_transaction([&] {
+                        for(size_t index = batch * batch_size; index < std::min(rows, (batch + 1) * batch_size); ++index) {
+                            BenchItem item(dataset[index]);
+                            item.save();
+                        }
+                    });
+                },
+                .raw = [&](size_t, size_t batch) {
+                    raw_exec("BEGIN;");
+                    for(size_t index = batch * batch_size; index < std::min(rows, (batch + 1) * batch_size); ++index) {
+                        raw_insert(raw_dataset[index]);
+                    }
+                    raw_exec("COMMIT;");
+                },
+                .operations = [](size_t rows) { return (rows + batch_size - 1) / batch_size; },
+            },
+        };
+
+        // Both sides of a workload start from the same table.
+        auto prepare = [&](const workload& w) {
+            if(w.name == "insert_single" || w.name == "transaction_batches") {
+                clear_table();
+            } else if(w.name != "insert_bulk" && BenchItem::count() != rows) {
+                fill_table(dataset);
+            }
+        };
+
+        for(size_t threads : options.threads) {
+            for(const workload& w : workloads) {
+                if(!w.concurrent && threads != options.threads.front()) {
+                    continue;
+                }
+
+                paired_result result;
+
+                prepare(w);
+                result.orm = run(w, w.orm, rows, threads);
+
+                prepare(w);
+                result.raw = run(w, w.raw, rows, threads);
+
+                std::cerr << std::format("{} rows={} threads={} orm {:.3f} ms, raw {:.3f} ms, overhead {:.2f}x\n", w.name, rows, result.orm.threads,
+                    std::chrono::duration<double, std::milli>(result.orm.wall).count(),
+                    std::chrono::duration<double, std::milli>(result.raw.wall).count(),
+                    result.overhead());
+
+                results.push_back(std::move(result));
+            }
+        }
+    }
+
+    if(options.output.empty()) {
+        write_json(std::cout, options, results);
+    } else {
+        std::ofstream file(options.output);
+
+        if(!file.is_open()) {
+            throw std::runtime_error(std::format("unable to open {}", options.output.string()));
+        }
+
+        write_json(file, options, results);
+    }
+
+    return 0;
+}
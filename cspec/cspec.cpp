@@ -4,6 +4,64 @@
 
 using namespace uva::database;
 
+// Performance expectations. They measure a function and are checked with eq(true), e.g.
+// expect(execute_at_most_queries(1, [](){ ... })).to eq(true)
+
+#ifndef UVA_DATABASE_COUNT_ALLOCATIONS
+// The library counts allocations itself when built with UVA_DATABASE_COUNT_ALLOCATIONS.
+static thread_local size_t spec_allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++spec_allocations;
+
+    if(void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static size_t allocations() { return spec_allocations; }
+#else
+static size_t allocations() { return thread_allocations(); }
+#endif
+
+static bool allocate_at_most(size_t count, std::function<void()> func)
+{
+    size_t before = allocations();
+    func();
+    return allocations() - before <= count;
+}
+
+// SQL function spec_sleep(ms), makes a query slow for sure without depending on the machine speed.
+static void register_spec_sleep()
+{
+    sqlite3* database = ((sqlite3_connection*)basic_connection::get_connection())->get_database();
+
+    sqlite3_create_function(database, "spec_sleep", 1, SQLITE_UTF8, nullptr, [](sqlite3_context* context, int argc, sqlite3_value** argv) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(sqlite3_value_int(argv[0])));
+        sqlite3_result_null(context);
+    }, nullptr, nullptr);
+}
+
+static bool execute_at_most_queries(size_t count, std::function<void()> func)
+{
+    size_t before = thread_queries();
+    func();
+    return thread_queries() - before <= count;
+}
+
 class Product : public basic_active_record
 {
     uva_database_declare(Product);
@@ -30,8 +88,45 @@ class MultipleValueHolder : public basic_active_record
 uva_database_declare(MultipleValueHolder);
 };
 
+class Country : public basic_active_record
+{
+uva_database_declare(Country);
+};
+
 uva_database_define(Product);
 uva_database_define(MultipleValueHolder);
+class Attachment : public basic_active_record
+{
+uva_database_declare(Attachment);
+};
+
+class CountryName : public basic_active_record
+{
+uva_database_declare(CountryName);
+uva_database_default_scope("");
+};
+
+// Reads only the country codes, the other columns are loaded on first access.
+class CountryCode : public basic_active_record
+{
+uva_database_declare(CountryCode);
+uva_database_select_exposed_columns();
+public:
+    uva_database_expose_column(code);
+};
+
+// Conflicts with the scope of Country, resolving its table throws.
+class RemovedCountry : public basic_active_record
+{
+uva_database_declare(RemovedCountry);
+uva_database_default_scope("removed = 1");
+};
+
+uva_database_define(Country);
+uva_database_define(Attachment);
+uva_database_define(CountryName);
+uva_database_define_full(CountryCode, "countries");
+uva_database_define_full(RemovedCountry, "countries");
 
 class AddProductsMigration : public basic_migration
 {
@@ -63,8 +158,61 @@ public:
     }
 };
 
+class AddCountriesMigration : public basic_migration
+{
+    uva_declare_migration(AddCountriesMigration);
+public:
+    virtual void change() override
+    {
+        add_table("countries",
+        {
+            { "id",         "INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL" },
+            { "code",       "TEXT NOT NULL" },
+            { "name",       "TEXT NOT NULL" },
+            { "updated_at", "INTEGER NOT NULL DEFAULT (STRFTIME('%s'))" },
+            { "created_at", "INTEGER NOT NULL DEFAULT (STRFTIME('%s'))" },
+            { "removed",    "INTEGER NOT NULL DEFAULT 0" },
+        });
+    }
+};
+
 uva_define_migration(AddProductsMigration)
 uva_define_migration(AddMultipleValueHoldersMigration)
+class AddAttachmentsMigration : public basic_migration
+{
+    uva_declare_migration(AddAttachmentsMigration);
+public:
+    virtual void change() override
+    {
+        add_table("attachments",
+        {
+            { "id",      "INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL" },
+            { "data",    "BLOB" },
+            { "removed", "INTEGER NOT NULL DEFAULT 0" },
+        });
+    }
+};
+
+class AddCountryNamesMigration : public basic_migration
+{
+    uva_declare_migration(AddCountryNamesMigration);
+public:
+    virtual void change() override
+    {
+        add_table("country_names",
+        {
+            { "country_code", "TEXT NOT NULL" },
+            { "locale",       "TEXT NOT NULL" },
+            { "name",         "TEXT NOT NULL" },
+            { "label",        "TEXT GENERATED ALWAYS AS (locale || ':' || name) VIRTUAL" },
+            { "removed",      "INTEGER NOT NULL DEFAULT 0" },
+        }, { .without_rowid = true, .strict = true, .primary_key = { "country_code", "locale" } });
+    }
+};
+
+uva_define_migration(AddCountriesMigration)
+uva_define_migration(AddAttachmentsMigration)
+uva_define_migration(AddCountryNamesMigration)
 
 static std::filesystem::path database_path;
 
@@ -74,6 +222,8 @@ cspec_describe("uva::database",
 
         before_all_tests([](){
             database_path = uva::cspec::temp_folder / "database.db";
+            // Specs capture std::cout, so queries are written from the calling thread.
+            set_logger(std::make_shared<cout_logger>());
         })
 
         it("should start without touching the database", []()
@@ -167,6 +317,173 @@ cspec_describe("uva::database",
                 "Deer", "Notebook", "Mobile Phone", "Book", "Perfume"
             }));
         })
+
+        it("should visit last 5 products without decoding them", [](){
+            std::vector<std::string> names;
+
+            Product::all().order_by("id desc").limit(5).each_row([&](const row_view& row) {
+                names.push_back(std::string(row.text("name")));
+            });
+
+            expect(names).to eq(std::vector<std::string>({
+                "Deer", "Notebook", "Mobile Phone", "Book", "Perfume"
+            }));
+        })
+    )
+
+    context("relations",
+        it("should share the query between copies until one of them changes it", [](){
+            active_record_relation all = Country::all();
+            active_record_relation copy;
+
+            expect(allocate_at_most(0, [&](){ copy = all; })).to eq(true);
+
+            copy.where("code = '{}'", "BR");
+
+            expect(all.to_sql().find("code")).to eq(std::string::npos);
+            expect(copy.to_sql().find("code = 'BR'")).to_not eq(std::string::npos);
+        })
+
+        it("should share the rows of a commit with copies", [](){
+            active_record_relation relation = Country::all();
+            relation.commit();
+
+            active_record_relation copy = relation;
+
+            expect(&copy.results() == &relation.results()).to eq(true);
+            expect(relation.count()).to eq(relation.results().size());
+        })
+    )
+
+    context("query statistics",
+        it("should aggregate queries by shape", [](){
+            enable_query_statistics = true;
+            reset_query_statistics();
+
+            Country::where("code = '{}'", "BR").count();
+            Country::where("code = '{}'", "PT").count();
+
+            enable_query_statistics = enable_query_statistics_default;
+
+            std::vector<query_statistics> statistics = get_query_statistics();
+
+            expect(statistics.size()).to eq(1);
+            expect(statistics[0].calls).to eq(2);
+            expect(statistics[0].shape).to eq(normalize_sql("SELECT COUNT(*) FROM countries WHERE code = 'x' AND removed = 0;"));
+        })
+    )
+
+    context("statement status",
+        it("should count full scan steps", [](){
+            active_record_relation relation = Product::where("name = '{}'", "Book");
+            relation.commit();
+
+            expect(relation.status().fullscan_steps > 0).to eq(true);
+            expect(relation.status().vm_steps > 0).to eq(true);
+        })
+    )
+
+    context("performance",
+        it("should iterate in batches instead of a query per row", [](){
+            for(const std::string& code : { "AD", "AE", "AF", "AG", "AI" }) {
+                Country::create({ { "code", code }, { "name", "Country " + code } });
+            }
+
+            size_t count = Country::count();
+            size_t visited = 0;
+
+            each_batch_size = 2;
+
+            expect(execute_at_most_queries(count / 2 + 1, [&](){
+                Country::each([&](Country& country) { ++visited; });
+            })).to eq(true);
+
+            each_batch_size = each_batch_size_default;
+
+            expect(visited).to eq(count);
+        })
+
+        it("should keep the limit of the relation when iterating in batches", [](){
+            size_t visited = 0;
+
+            each_batch_size = 2;
+            Country::where("id > {}", 0).limit(3).each([&](std::map<std::string, var>& country) { ++visited; });
+            each_batch_size = each_batch_size_default;
+
+            expect(visited).to eq(3);
+        })
+
+        it("should find a record by id with a single query", [](){
+            size_t id = Country::first()["id"];
+
+            expect(execute_at_most_queries(1, [id](){
+                Country::find_by("id = {}", id);
+            })).to eq(true);
+        })
+
+        it("should count with a bounded number of allocations", [](){
+            expect(allocate_at_most(1000, [](){
+                Product::count();
+            })).to eq(true);
+        })
+
+        it("should check applied migrations with a constant number of queries", [](){
+            expect(execute_at_most_queries(2, [](){
+                basic_migration::do_pending_migrations();
+            })).to eq(true);
+        })
+
+        it("should count with a single query", [](){
+            expect(execute_at_most_queries(1, [](){
+                Product::count();
+            })).to eq(true);
+        })
+    )
+
+    context("profiler",
+        it("should time every stage of a call site", [](){
+            enable_profiler = true;
+            reset_profiles();
+
+            {
+                profiler_scope scope("first country");
+                Country::first();
+            }
+
+            enable_profiler = enable_profiler_default;
+
+            std::vector<call_site_profile> profiles = get_profiles();
+
+            expect(profiles.size()).to eq(1);
+            expect(profiles[0].call_site).to eq(std::string("first country"));
+            expect(profiles[0].stages[(size_t)profiler_stage::build].calls > 0).to eq(true);
+            expect(profiles[0].stages[(size_t)profiler_stage::step].calls > 0).to eq(true);
+            expect(profiles[0].stages[(size_t)profiler_stage::record].calls).to eq(1);
+        })
+    )
+
+    context("slow queries",
+        it("should explain the plan of a query", [](){
+            expect(explain_query_plan("SELECT * FROM countries WHERE id = 1;").find("countries")).to_not eq(std::string::npos);
+        })
+
+        it("should append slow queries to the log file", [](){
+            std::filesystem::path path = std::filesystem::temp_directory_path() / "uva_slow_queries.log";
+            std::filesystem::remove(path);
+
+            register_spec_sleep();
+
+            slow_query_threshold = std::chrono::milliseconds(10);
+            slow_query_log_path = path;
+
+            // Sleeps far longer than the threshold, so the query is slow however fast the machine is.
+            active_record_relation().commit("SELECT spec_sleep(200);");
+
+            slow_query_threshold = slow_query_threshold_default;
+            slow_query_log_path.clear();
+
+            expect(std::filesystem::exists(path)).to eq(true);
+        })
     )
 
     context("callbacks",
@@ -242,6 +559,446 @@ cspec_describe("uva::database",
             expect(product["null_value"].type).to eq(multiple_value_holder::value_type::null_type);
 
         })
+
+        it("should decode expressions and declared types by their affinity", [](){
+            active_record_relation relation;
+            relation.commit("SELECT 'text' AS string, 42 AS integer, 4.2 AS float, CAST(1 AS BOOLEAN) AS boolean, CAST('x' AS VARCHAR(255)) AS varchar;");
+
+            expect(relation.results().size()).to eq(1);
+
+            expect(relation.results()[0][0].type).to eq(multiple_value_holder::value_type::string);
+            expect(relation.results()[0][1].type).to eq(multiple_value_holder::value_type::integer);
+            expect(relation.results()[0][2].type).to eq(multiple_value_holder::value_type::real);
+            expect(relation.results()[0][3].type).to eq(multiple_value_holder::value_type::integer);
+            expect(relation.results()[0][4].type).to eq(multiple_value_holder::value_type::string);
+        })
+    )
+
+    context("blobs",
+        it("should write and read binary data", [](){
+            sqlite3_connection* connection = (sqlite3_connection*)basic_connection::get_connection();
+
+            Attachment attachment = Attachment::create({ { "removed", 0 } });
+            size_t id = attachment["id"].to_i();
+
+            const char data[] = { 'a', '\0', 'b', '\xff', 'c' };
+            connection->write_blob(Attachment::table(), "data", id, data, sizeof(data));
+
+            char buffer[sizeof(data)] = {};
+            expect(connection->read_blob(Attachment::table(), "data", id, buffer, sizeof(buffer))).to eq(sizeof(data));
+            expect(std::string(buffer, sizeof(buffer))).to eq(std::string(data, sizeof(data)));
+
+            expect(Attachment::find_by("id={}", id)["data"]).to eq(std::string(data, sizeof(data)));
+        })
+
+        it("should stream a blob in chunks", [](){
+            sqlite3_connection* connection = (sqlite3_connection*)basic_connection::get_connection();
+
+            Attachment attachment = Attachment::create({ { "removed", 0 } });
+            size_t id = attachment["id"].to_i();
+
+            connection->allocate_blob(Attachment::table(), "data", id, 1024);
+
+            std::string chunk(256, 'x');
+
+            blob_stream writer(Attachment::table(), "data", id, true);
+            for(size_t i = 0; i < 4; ++i) {
+                writer.write(chunk.data(), chunk.size());
+            }
+
+            blob_stream reader(Attachment::table(), "data", id);
+            expect(reader.size()).to eq(1024);
+
+            size_t total = 0;
+            char buffer[300];
+            while(size_t read = reader.read(buffer, sizeof(buffer))) {
+                total += read;
+            }
+
+            expect(total).to eq(1024);
+        })
+    )
+
+    context("cached tables",
+        before_all_tests([](){
+            Country::create({
+                { "code", "BR" },
+                { "name", "Brazil" },
+            });
+
+            Country::cache();
+        })
+
+        it("should find cached rows without querying", [](){
+            size_t id = Country::table()->find_by({ { "code", "BR" } });
+
+            expect(id).to_not eq(std::string::npos);
+            expect(Country::table()->at(id, "name")).to eq(std::string("Brazil"));
+        })
+
+        it("should see rows written after cache", [](){
+            Country country = Country::create({
+                { "code", "PT" },
+                { "name", "Portugal" },
+            });
+
+            size_t id = country["id"].to_i();
+
+            expect(Country::table()->find(id)).to eq(id);
+
+            country.update("name", "Portuguese Republic");
+            expect(Country::table()->at(id, "name")).to eq(std::string("Portuguese Republic"));
+
+            country.destroy();
+            expect(Country::table()->find(id)).to eq(std::string::npos);
+        })
+
+        it("should keep cache indexes up to date", [](){
+            Country::table()->add_cache_index({ "code" });
+            Country::table()->add_cache_index({ "name" }, cache_index_type::sorted);
+
+            Country country = Country::create({
+                { "code", "AR" },
+                { "name", "Argentina" },
+            });
+
+            size_t id = country["id"].to_i();
+
+            expect(Country::table()->find_by({ { "code", "AR" } })).to eq(id);
+            expect(Country::table()->find_range({ "name" }, { "A" }, { "B" })).to eq(std::vector<size_t>({ id }));
+
+            country.update("code", "RA");
+            expect(Country::table()->find_by({ { "code", "AR" } })).to eq(std::string::npos);
+            expect(Country::table()->find_by({ { "code", "RA" } })).to eq(id);
+        })
+
+        it("should see rows deleted without a condition", [](){
+            Attachment attachment = Attachment::create({ { "removed", 0 } });
+            size_t id = attachment["id"].to_i();
+
+            Attachment::cache();
+            expect(Attachment::table()->find(id)).to eq(id);
+
+            active_record_relation().commit("DELETE FROM attachments;");
+
+            expect(Attachment::table()->find(id)).to eq(std::string::npos);
+        })
+
+        it("should refuse to cache WITHOUT ROWID tables", [](){
+            bool refused = false;
+
+            try {
+                CountryName::cache();
+            } catch(const std::runtime_error&) {
+                refused = true;
+            }
+
+            expect(refused).to eq(true);
+        })
+
+        it("should compare integer keys of sorted cache indexes as numbers", [](){
+            for(size_t i = 0; i < 10; ++i) {
+                Country::create({ { "code", std::format("N{}", i) }, { "name", std::format("Number {}", i) } });
+            }
+
+            Country nine = Country::find_by("id = {}", 9);
+
+            if(nine.present()) {
+                nine.destroy();
+            }
+
+            Country::table()->add_cache_index({ "id" }, cache_index_type::sorted);
+
+            // As text, "10" and every larger id sort before "9".
+            expect(Country::table()->find_by({ { "id", "9" } })).to eq(std::string::npos);
+            expect(Country::table()->find_by({ { "id", "10" } })).to eq(10);
+            expect(Country::table()->find_range({ "id" }, { "9" }, { "10" })).to eq(std::vector<size_t>({ 10 }));
+        })
+    )
+
+    context("transactions",
+        it("should roll back when the function throws", [](){
+            size_t count = Country::count();
+
+            try {
+                within_transaction([](){
+                    Country::create({
+                        { "code", "XX" },
+                        { "name", "Nowhere" },
+                    });
+
+                    throw std::runtime_error("abort");
+                });
+            } catch(const std::runtime_error&) {
+
+            }
+
+            expect(Country::count()).to eq(count);
+        })
+    )
+
+    context("template databases",
+        it("should hand out isolated copies of a migrated database", [](){
+            template_database templ(uva::cspec::temp_folder / "template.db");
+
+            size_t count = Country::count();
+
+            std::vector<std::thread> threads;
+            std::vector<size_t> counts(3);
+
+            template_database::clone_mode modes[] = {
+                template_database::clone_mode::file,
+                template_database::clone_mode::backup,
+                template_database::clone_mode::deserialize,
+            };
+
+            for(size_t i = 0; i < 3; ++i) {
+                threads.emplace_back([&, i](){
+                    std::unique_ptr<sqlite3_connection> connection = templ.clone(modes[i], uva::cspec::temp_folder / std::format("clone_{}.db", i));
+                    connection_scope scope(connection.get());
+
+                    std::string code = std::format("T{}", i);
+                    Country::create({ { "code", code }, { "name", "Country " + code } });
+
+                    counts[i] = Country::count();
+                });
+            }
+
+            for(std::thread& thread : threads) {
+                thread.join();
+            }
+
+            expect(counts).to eq(std::vector<size_t>({ 1, 1, 1 }));
+            expect(Country::count()).to eq(count);
+        })
+    )
+
+    context("schema snapshot",
+        it("should dump and load the schema with the applied migrations", [](){
+            std::filesystem::path path = uva::cspec::temp_folder / "schema.sql";
+
+            basic_migration::dump_schema(path);
+
+            std::ifstream file(path);
+            std::string schema((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+            expect(schema.find("CREATE TABLE IF NOT EXISTS products")).to_not eq(std::string::npos);
+            expect(schema.find("'AddProductsMigration'")).to_not eq(std::string::npos);
+
+            size_t count = Product::count();
+
+            basic_migration::load_schema_snapshot(path);
+
+            expect(Product::count()).to eq(count);
+        })
+    )
+
+    context("indexes",
+        it("should index only the default scope of tables with a removed column", [](){
+            basic_migration::add_index("countries", "code", { .scope = index_scope::default_scope });
+
+            const auto& indexes = Country::table()->m_indexes;
+            auto it = std::find_if(indexes.begin(), indexes.end(), [](const table::index_definition& index) {
+                return index.name == "idx_countries_on_code";
+            });
+
+            expect(it != indexes.end()).to eq(true);
+            expect(it->partial).to eq(true);
+            expect(explain_query_plan(Country::where("code = '{}'", "BR").to_sql()).find("idx_countries_on_code")).to_not eq(std::string::npos);
+        })
+
+        it("should create unique covering indexes", [](){
+            basic_migration::add_index("countries", "code", { .unique = true, .include = { "name" } });
+
+            const auto& indexes = Country::table()->m_indexes;
+            auto it = std::find_if(indexes.begin(), indexes.end(), [](const table::index_definition& index) {
+                return index.name == "idx_countries_on_code_name";
+            });
+
+            expect(it != indexes.end()).to eq(true);
+            expect(it->unique).to eq(true);
+            expect(it->partial).to eq(false);
+            expect(it->columns).to eq(std::vector<std::string>({ "code", "name" }));
+        })
+    )
+
+    context("default scope",
+        it("should scope only tables with a removed column", [](){
+            expect(Country::all().to_sql().find("WHERE removed = 0")).to_not eq(std::string::npos);
+            expect(Product::all().to_sql().find("WHERE")).to eq(std::string::npos);
+        })
+
+        it("should use the scope declared by the model", [](){
+            expect(CountryName::table()->m_default_scope).to eq(std::string());
+            expect(CountryName::where("locale = '{}'", "pt").to_sql().find("removed")).to eq(std::string::npos);
+        })
+
+        it("should refuse models declaring different scopes for the same table", [](){
+            bool refused = false;
+
+            Country::table();
+
+            try {
+                RemovedCountry::table();
+            } catch(const std::runtime_error&) {
+                refused = true;
+            }
+
+            expect(refused).to eq(true);
+            expect(Country::table()->m_default_scope).to eq(std::string("removed = 0"));
+        })
+    )
+
+    context("projections",
+        it("should select only the exposed columns and the primary key", [](){
+            expect(CountryCode::all().to_sql().find("SELECT id,code FROM countries")).to_not eq(std::string::npos);
+            expect(Country::only({ "name" }).to_sql().find("SELECT id,name FROM countries")).to_not eq(std::string::npos);
+            expect(CountryName::only({ "name" }).to_sql().find("SELECT country_code,locale,name FROM country_names")).to_not eq(std::string::npos);
+        })
+
+        it("should load the other columns on first access", [](){
+            CountryCode country = CountryCode::first();
+            std::string name;
+
+            expect(execute_at_most_queries(1, [&](){
+                name = country["name"].to_s();
+                name += country["created_at"].to_s();
+            })).to eq(true);
+
+            Country full = Country::first();
+            expect(name).to eq(full["name"].to_s() + full["created_at"].to_s());
+        })
+    )
+
+    context("primary keys",
+        it("should create clustered tables with a composite primary key", [](){
+            const table* names = CountryName::table();
+
+            expect(names->m_without_rowid).to eq(true);
+            expect(names->m_strict).to eq(true);
+            expect(names->primary_key).to eq(std::string("country_code,locale"));
+            expect(names->m_generated_columns.contains("label")).to eq(true);
+        })
+
+        it("should save records by their primary key", [](){
+            CountryName::create({ { "country_code", "BR" }, { "locale", "pt" }, { "name", "Brasil" } });
+            CountryName name = CountryName::create({ { "country_code", "BR" }, { "locale", "pt" }, { "name", "Brazil" } });
+
+            expect(name.present()).to eq(true);
+            expect(name["label"].to_s()).to eq(std::string("pt:Brazil"));
+            expect(CountryName::where("country_code = '{}'", "BR").count()).to eq(1);
+
+            name["name"] = "Brasil";
+            name.save();
+            name.reload();
+
+            expect(name["label"].to_s()).to eq(std::string("pt:Brasil"));
+        })
+
+        it("should update and destroy records by their primary key", [](){
+            CountryName name = CountryName::create({ { "country_code", "AR" }, { "locale", "es" }, { "name", "Argentina" } });
+            CountryName::create({ { "country_code", "AR" }, { "locale", "pt" }, { "name", "Argentina" } });
+
+            name.update("locale", "en");
+
+            expect(CountryName::where("country_code = '{}' AND locale = '{}'", "AR", "en").count()).to eq(1);
+            expect(CountryName::where("country_code = '{}' AND locale = '{}'", "AR", "pt").count()).to eq(1);
+
+            name.destroy();
+
+            expect(CountryName::where("country_code = '{}'", "AR").count()).to eq(1);
+        })
+    )
+
+    context("altering tables",
+        it("should add a column keeping existing rows", [](){
+            size_t count = Country::count();
+
+            Country::table()->add_column("population", "INTEGER NOT NULL", "0");
+
+            expect(Country::count()).to eq(count);
+            expect(Country::first()["population"].to_i()).to eq(0);
+            expect(Country::table()->column_type("population")).to eq(var::var_type::integer);
+        })
+
+        it("should add a column declaring its own default", [](){
+            size_t count = Country::count();
+
+            Country::table()->add_column("continent", "TEXT NOT NULL DEFAULT 'unknown'", "");
+
+            expect(Country::count()).to eq(count);
+            expect(Country::first()["continent"].to_s()).to eq(std::string("unknown"));
+        })
+
+        it("should rebuild a table online in chunks", [](){
+            size_t count = Country::count();
+            size_t copied = 0;
+
+            enable_online_rebuild = true;
+            online_rebuild_chunk_size = 1;
+            set_rebuild_progress_hook([&](const std::string& table, size_t rows, size_t total) {
+                copied = rows;
+            });
+
+            Country::table()->change_column("population", "REAL NOT NULL DEFAULT 0");
+
+            set_rebuild_progress_hook(nullptr);
+            online_rebuild_chunk_size = online_rebuild_chunk_size_default;
+            enable_online_rebuild = enable_online_rebuild_default;
+
+            expect(copied).to eq(count);
+            expect(Country::count()).to eq(count);
+            expect(Country::table()->column_type("population")).to eq(var::var_type::real);
+        })
+
+        it("should rebuild tables without an id online by rowid", [](){
+            size_t count = Product::count();
+
+            enable_online_rebuild = true;
+            online_rebuild_chunk_size = 1;
+
+            Product::table()->change_column("price", "NUMERIC");
+
+            online_rebuild_chunk_size = online_rebuild_chunk_size_default;
+            enable_online_rebuild = enable_online_rebuild_default;
+
+            expect(Product::count()).to eq(count);
+        })
+
+        it("should refuse to rebuild WITHOUT ROWID tables online", [](){
+            bool refused = false;
+
+            enable_online_rebuild = true;
+
+            try {
+                CountryName::table()->change_column("name", "TEXT NOT NULL DEFAULT ''");
+            } catch(const std::runtime_error&) {
+                refused = true;
+            }
+
+            enable_online_rebuild = enable_online_rebuild_default;
+
+            expect(refused).to eq(true);
+        })
+
+        it("should refuse to rebuild a table online inside a transaction", [](){
+            bool refused = false;
+
+            enable_online_rebuild = true;
+
+            try {
+                within_transaction([](){
+                    Country::table()->change_column("population", "INTEGER NOT NULL DEFAULT 0");
+                });
+            } catch(const std::runtime_error&) {
+                refused = true;
+            }
+
+            enable_online_rebuild = enable_online_rebuild_default;
+
+            expect(refused).to eq(true);
+            expect(Country::table()->column_type("population")).to eq(var::var_type::real);
+        })
     )
 );
 
@@ -4,11 +4,24 @@
 #include <filesystem>
 #include <map>
 #include <map>
+#include <set>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <mutex>
 #include <exception>
 #include <vector>
 #include <iterator>
 #include <functional>
 #include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <array>
+#include <source_location>
+#include <optional>
 #include <format>
 #include "sqlite3.h"
 
@@ -39,21 +52,27 @@ public:\
     static record create(std::map<std::string, var>&& relations) {\
         record r(std::forward<std::map<std::string, var>>(relations)); \
         r.save();\
-        r = record::find_by("id={}", r["id"]);\
+        r.reload();\
         return r;\
     } \
     static record create(const std::map<std::string, var>& relations) {\
         record r(relations); \
         r.save();\
-        r = record::find_by("id={}", r["id"]);\
+        r.reload();\
         return r;\
     } \
     static void create(std::vector<var>& rows, const std::vector<std::string>& columns) { table()->create(rows, columns); } \
     static void create(var& rows, const std::vector<std::string>& columns) { table()->create(rows, columns); } \
     static void create(std::vector<std::map<std::string, var>>& relations) { table()->create(relations); } \
+    static void cache() { table()->cache(); } \
     static size_t column_count() { return table()->m_columns.size(); } \
     static std::vector<std::pair<std::string, std::string>>& columns() { return table()->m_columns; } \
-    static uva::database::active_record_relation all() { return uva::database::active_record_relation(table()).select("*").from(table()->m_name);  } \
+    static uva::database::active_record_relation all() {\
+        return record::selects_exposed_columns() ? record::select_exposed() : uva::database::active_record_relation(table()).select("*").from(table()->m_name);\
+    } \
+    static std::vector<std::string> exposed_column_names() { return record().exposed_columns(); } \
+    static uva::database::active_record_relation select_exposed() { return uva::database::active_record_relation(table()).from(table()->m_name).only(exposed_column_names()); } \
+    static uva::database::active_record_relation only(const std::vector<std::string>& columns) { return record::all().only(columns); } \
     template<class... Args> static uva::database::active_record_relation where(const std::string where, Args const&... args) { return record::all().where(where, args...); }\
     static uva::database::active_record_relation from(const std::string& from) { return record::all().from(from); } \
     static uva::database::active_record_relation select(const std::string& select) { return record::all().select(select); } \
@@ -65,25 +84,26 @@ public:\
     static void each(std::function<void(std::map<std::string, var>&)> func) { return record::all().each(func); }\
     static void each_with_index(std::function<void(record&, const size_t&)> func) { return record::all().each_with_index<record>(func); }\
     static void each(std::function<void(record&)> func) { return record::all().each<record>(func); }\
-    template<class... Args> static record find_by(std::string where, Args const&... args) { return record(record::all().find_by(where, args...)); }\
-    static record find_by(std::map<var, var>&& v) { return record(record::all().where(std::move(v))); }\
+    static void each_row(std::function<void(const uva::database::row_view&)> func) { return record::all().each_row(func); }\
+    template<class... Args> static record find_by(std::string where, Args const&... args) { return uva::database::make_record<record>(record::all().find_by(where, args...)); }\
+    static record find_by(std::map<var, var>&& v) { return uva::database::make_record<record>(record::all().where(std::move(v))); }\
     static record find_or_create_by(std::map<var, var>&& v) {\
         auto result = record::find_by(std::move(std::map<var, var>(v)));\
 \
         if(!result.present()) {\
             record r(std::move(v));\
             r.save();\
-\
-            r = record::find_by("id={}", r["id"]);\
+            r.reload();\
             return r;\
         }\
         return result;\
     }\
-    static record first() { return all().first(); }\
+    static record first() { return uva::database::make_record<record>(all().first()); }\
     record& operator=(const record& other)\
     {\
         id = other.id;\
         values = other.values;\
+        m_lazy_columns = other.m_lazy_columns;\
         return *this;\
     }\
     virtual const std::string& class_name() const override\
@@ -92,6 +112,16 @@ public:\
         return class_name;\
     };\
 
+// Replaces the default scope of a model, e.g. uva_database_default_scope("archived = 0"). An empty scope disables it.
+#define uva_database_default_scope(scope)\
+public:\
+    static const char* default_scope() { return scope; }
+
+// Makes Model::all() select only the exposed columns and the primary key. The others are loaded on first access.
+#define uva_database_select_exposed_columns()\
+public:\
+    static bool selects_exposed_columns() { return true; }
+
 #define uva_database_expose_column(column_name)\
     uva::database::basic_active_record_column column_name = { #column_name, (basic_active_record*)this };
 
@@ -100,7 +130,11 @@ uva::database::table* record::table() { \
 \
     static std::string table_name = __table_name; \
 \
-    static uva::database::table* table = uva::database::table::get_table(table_name);\
+    static uva::database::table* table = [](){\
+        uva::database::table* created = uva::database::table::get_table(table_name);\
+        created->declare_default_scope(record::default_scope());\
+        return created;\
+    }();\
     \
     return table; \
 }\
@@ -115,6 +149,8 @@ uva::database::table* record::table() { \
 
 #define uva_run_migrations() uva::database::basic_migration::do_pending_migrations();
 
+#define uva_bootstrap_database(schema) uva::database::basic_migration::bootstrap(schema);
+
 namespace uva
 {
     namespace database
@@ -127,18 +163,339 @@ namespace uva
         // Default value of query_buffer_lenght. Don't change this. You can change query_buffer_lenght.
         static constexpr bool enable_query_cout_printing_default = true;
         extern bool enable_query_cout_printing;
+        // Default value of each_batch_size. Don't change this. You can change each_batch_size.
+        static constexpr size_t each_batch_size_default = 1000;
+        // Rows loaded by each query of each() and each_with_index().
+        extern size_t each_batch_size;
+        // Default value of enable_online_rebuild. Don't change this. You can change enable_online_rebuild.
+        static constexpr bool enable_online_rebuild_default = false;
+        // Table rebuilds (change_column and add_column when ALTER TABLE can't be used) copy rows in rowid-ordered chunks, each in
+        // its own transaction, while triggers forward concurrent writes to the copy. Only the final swap blocks writers.
+        // WITHOUT ROWID tables can't be rebuilt online, alter_table throws for them.
+        extern bool enable_online_rebuild;
+        // Default value of online_rebuild_chunk_size. Don't change this. You can change online_rebuild_chunk_size.
+        static constexpr size_t online_rebuild_chunk_size_default = 10000;
+        extern size_t online_rebuild_chunk_size;
+
+        enum class log_level
+        {
+            trace,
+            debug,
+            info,
+            warning,
+            error,
+            none,
+        };
+
+        // What is known about a query when it finishes. Formatting is left to the logger that emits it.
+        struct log_record
+        {
+            log_level level = log_level::debug;
+            std::chrono::nanoseconds elapsed = std::chrono::nanoseconds::zero();
+            std::string sql;
+            std::string error;
+            size_t rows = 0;
+            // EXPLAIN QUERY PLAN output, only filled for slow queries.
+            std::string plan;
+        };
+
+        class basic_logger
+        {
+        public:
+            virtual ~basic_logger() = default;
+        public:
+            // Records below this level are discarded before being built.
+            std::atomic<log_level> level = log_level::debug;
+            // Keep only one of every sample_rate records below warning. Warnings and errors are always kept.
+            std::atomic<size_t> sample_rate = 1;
+        private:
+            std::atomic<size_t> m_sampled = 0;
+        public:
+            bool should_log(log_level record_level);
+            virtual void log(log_record&& record) = 0;
+            virtual void flush() { }
+        };
+
+        // Writes records synchronously to std::cout, colored by their result.
+        class cout_logger : public basic_logger
+        {
+        public:
+            virtual void log(log_record&& record) override;
+            virtual void flush() override;
+        };
+
+        // Queues records in a bounded lock-free ring buffer and hands them to sink from a background thread,
+        // so the querying thread never formats nor writes. Records are dropped (and counted) when the buffer is full.
+        class async_logger : public basic_logger
+        {
+        public:
+            async_logger(std::shared_ptr<basic_logger> sink, size_t capacity = 4096);
+            ~async_logger();
+        private:
+            struct cell
+            {
+                std::atomic<size_t> sequence;
+                log_record record;
+            };
+            std::shared_ptr<basic_logger> m_sink;
+            std::unique_ptr<cell[]> m_cells;
+            size_t m_mask;
+            std::atomic<size_t> m_enqueue_position = 0;
+            size_t m_dequeue_position = 0;
+            std::atomic<size_t> m_written = 0;
+            std::atomic<size_t> m_dropped = 0;
+            std::atomic<bool> m_idle = false;
+            std::atomic<bool> m_stopping = false;
+            std::mutex m_mutex;
+            std::condition_variable m_condition;
+            std::thread m_thread;
+        private:
+            bool pop(log_record& record);
+            void run();
+        public:
+            virtual void log(log_record&& record) override;
+            // Blocks until every record logged before the call has been written.
+            virtual void flush() override;
+            size_t dropped() const { return m_dropped; }
+        };
+
+        // The default logger is an async_logger writing to a cout_logger.
+        std::shared_ptr<basic_logger> get_logger();
+        void set_logger(std::shared_ptr<basic_logger> logger);
+
+        // Default value of enable_query_statistics. Don't change this. You can change enable_query_statistics.
+        static constexpr bool enable_query_statistics_default = false;
+        // Accumulates query_statistics for every query. Costs a normalization and a locked map update per query.
+        extern bool enable_query_statistics;
+
+        // Work done by SQLite for a statement, see https://www.sqlite.org/c3ref/c_stmtstatus_counter.html
+        struct statement_status
+        {
+            // Rows stepped through full table scans.
+            int64_t fullscan_steps = 0;
+            int64_t sorts = 0;
+            // Rows inserted into automatic (temporary) indexes, usually a missing index.
+            int64_t autoindexes = 0;
+            int64_t vm_steps = 0;
+            int64_t reprepares = 0;
+            // Bytes of heap held by the prepared statement.
+            int64_t memused = 0;
+
+            statement_status& operator+=(const statement_status& other);
+        };
+
+        // Called after a statement for which SQLite built an automatic index.
+        using autoindex_hook = std::function<void(const std::string& sql, const statement_status& status)>;
+        autoindex_hook get_autoindex_hook();
+        // Pass nullptr to remove the hook.
+        void set_autoindex_hook(autoindex_hook hook);
+
+        // Called after each chunk of an online rebuild with the rows copied so far and the rows the table had when it started.
+        using rebuild_progress_hook = std::function<void(const std::string& table, size_t copied, size_t total)>;
+        rebuild_progress_hook get_rebuild_progress_hook();
+        // Pass nullptr to remove the hook.
+        void set_rebuild_progress_hook(rebuild_progress_hook hook);
+
+        // Aggregated cost of every query with the same shape.
+        struct query_statistics
+        {
+            static constexpr size_t buckets = 40;
+
+            std::string shape;
+            size_t calls = 0;
+            std::chrono::nanoseconds total = std::chrono::nanoseconds::zero();
+            size_t rows = 0;
+            size_t sql_bytes = 0;
+            // Sum of the statement_status of every call. memused is the largest seen.
+            statement_status status;
+            // Calls by latency, bucket i counts queries faster than 2^i microseconds.
+            std::array<size_t, buckets> histogram = {};
+
+            std::chrono::nanoseconds mean() const;
+            // Upper bound of the histogram bucket holding the given percentile (0-100).
+            std::chrono::nanoseconds percentile(double percentile) const;
+        };
+
+        // Default value of slow_query_threshold. Don't change this. You can change slow_query_threshold.
+        static constexpr std::chrono::milliseconds slow_query_threshold_default = std::chrono::milliseconds::zero();
+        // Queries slower than this are logged as warnings with their EXPLAIN QUERY PLAN. Zero disables it.
+        extern std::chrono::milliseconds slow_query_threshold;
+        // When not empty, slow queries are also appended to this file.
+        extern std::filesystem::path slow_query_log_path;
+
+        // The plan of a statement as an indented tree, one step per line (e.g. "SCAN users").
+        std::string explain_query_plan(const std::string& sql);
+
+        // Replaces literals (strings and numbers) by ? and collapses lists of values, so
+        // "WHERE id IN (1, 2, 3)" and "WHERE id IN (7)" have the same shape.
+        std::string normalize_sql(const std::string& sql);
+        void record_query_statistics(const std::string& sql, std::chrono::nanoseconds elapsed, size_t rows, const statement_status& status = {});
+        // Every shape recorded since the start (or the last reset), most expensive first.
+        std::vector<query_statistics> get_query_statistics();
+        void reset_query_statistics();
+        // Writes get_query_statistics() as a JSON array.
+        void dump_query_statistics(const std::filesystem::path& path);
+
+        // Default value of enable_profiler. Don't change this. You can change enable_profiler.
+        static constexpr bool enable_profiler_default = false;
+        // Times every stage of the ORM (see profiler_stage) and aggregates it per call site.
+        extern bool enable_profiler;
+
+        // Stages of an operation, from the SQL string to the record.
+        enum class profiler_stage
+        {
+            // commit_sql()
+            build,
+            // Statement cache lookup or sqlite3_prepare_v2
+            prepare,
+            // sqlite3_step
+            step,
+            // Columns into vars
+            decode,
+            // Result rows into std::map<std::string, var>
+            row_map,
+            // Maps into records, including exposed columns
+            record,
+        };
+        static constexpr size_t profiler_stages = 6;
+        std::string_view profiler_stage_name(profiler_stage stage);
+
+        struct stage_profile
+        {
+            size_t calls = 0;
+            std::chrono::nanoseconds total = std::chrono::nanoseconds::zero();
+            // Calls to operator new, only counted when built with UVA_DATABASE_COUNT_ALLOCATIONS.
+            size_t allocations = 0;
+        };
+
+        struct call_site_profile
+        {
+            std::string call_site;
+            std::array<stage_profile, profiler_stages> stages = {};
+        };
+
+        // Calls to operator new made by this thread. Always 0 unless built with UVA_DATABASE_COUNT_ALLOCATIONS.
+        size_t thread_allocations();
+        // Queries run by this thread (commit, commit_without_prepare and each_row), failed ones included.
+        size_t thread_queries();
+
+        // Stages timed while a profiler_scope is alive are attributed to its call site (file:line by default).
+        // Scopes nest, the innermost wins. Stages outside any scope go to "(unscoped)".
+        class profiler_scope
+        {
+        public:
+            profiler_scope(std::source_location location = std::source_location::current());
+            profiler_scope(std::string call_site);
+            ~profiler_scope();
+            profiler_scope(const profiler_scope&) = delete;
+            profiler_scope& operator=(const profiler_scope&) = delete;
+        private:
+            std::string m_call_site;
+            const std::string* m_previous;
+        };
+
+        #define uva_database_profile() uva::database::profiler_scope __uva_database_profiler_scope
+
+        // Accumulates the time of a stage between start() and stop(), which can be called
+        // several times (e.g. once per row). Records a single call when destroyed.
+        class stage_timer
+        {
+        public:
+            stage_timer(profiler_stage stage, bool started = true)
+                : m_stage(stage), m_enabled(enable_profiler)
+            {
+                if(started) {
+                    start();
+                }
+            }
+            ~stage_timer()
+            {
+                if(m_enabled) {
+                    stop();
+                    record();
+                }
+            }
+            stage_timer(const stage_timer&) = delete;
+            stage_timer& operator=(const stage_timer&) = delete;
+        private:
+            profiler_stage m_stage;
+            bool m_enabled;
+            bool m_running = false;
+            std::chrono::steady_clock::time_point m_start;
+            std::chrono::nanoseconds m_elapsed = std::chrono::nanoseconds::zero();
+            size_t m_allocations_start = 0;
+            size_t m_allocations = 0;
+        public:
+            void start()
+            {
+                if(m_enabled && !m_running) {
+                    m_running = true;
+                    m_allocations_start = thread_allocations();
+                    m_start = std::chrono::steady_clock::now();
+                }
+            }
+            void stop()
+            {
+                if(m_running) {
+                    m_elapsed += std::chrono::steady_clock::now() - m_start;
+                    m_allocations += thread_allocations() - m_allocations_start;
+                    m_running = false;
+                }
+            }
+        private:
+            void record();
+        };
+
+        // Builds a record from a row, timed as profiler_stage::record. Columns not selected by the query
+        // are loaded on first access.
+        template<class record, class value_type>
+        record make_record(value_type&& value)
+        {
+            stage_timer timer(profiler_stage::record);
+            record r(std::forward<value_type>(value));
+            r.m_lazy_columns = true;
+            return r;
+        }
+
+        // Every call site profiled since the start (or the last reset).
+        std::vector<call_site_profile> get_profiles();
+        void reset_profiles();
         class table;
         class basic_active_record;
         class basic_active_record_column;
 
         void within_transaction(std::function<void()> __f);
 
+        // Column affinity of a declared type, see https://www.sqlite.org/datatype3.html#determination_of_column_affinity
+        enum class column_affinity
+        {
+            integer,
+            text,
+            blob,
+            real,
+            numeric,
+        };
+
+        column_affinity sql_type_affinity(const char* declared_type);
+
+        // Appends the value of a result column to a row. Chosen once per prepared statement from the column affinity.
+        using column_decoder = void(*)(sqlite3_stmt* stmt, int column, std::vector<var>& row);
+        column_decoder sql_column_decoder(column_affinity affinity);
+
         class basic_connection
         {
+        protected:
+            static std::atomic<basic_connection*> s_connection;
         private:
-            static basic_connection* s_connection;
+            static thread_local basic_connection* s_thread_connection;
         public:
+            // Tag for connections which never become the default connection (e.g. template_database clones).
+            struct detached_t { explicit detached_t() = default; };
+            static constexpr detached_t detached{};
+        public:
+            // The first connection created, and every connection after it, becomes the default connection.
             basic_connection();
+            basic_connection(detached_t);
         public:
             virtual bool open() = 0;
             virtual bool is_open() const = 0;
@@ -149,42 +506,187 @@ namespace uva
             virtual void destroy(size_t id, uva::database::table* table) = 0;
             virtual void add_column(uva::database::table* table, const std::string& name, const std::string& type, const std::string& default_value) = 0;
             virtual void change_column(uva::database::table* table, const std::string& name, const std::string& type) = 0;
+            // Reads columns, primary key and indexes of a table from the database.
+            virtual void read_schema(table* table) = 0;
+            virtual void load_schema() = 0;
             virtual void begin_transaction() = 0;
             virtual void end_transaction() = 0;
+            virtual void rollback_transaction() = 0;
+            // The connection of the calling thread if it has one, the default connection otherwise.
             static basic_connection* get_connection();
+            static basic_connection* get_default_connection();
+            static void set_default_connection(basic_connection* connection);
+            // Makes get_connection() return connection in the calling thread only. Pass nullptr to use the default connection again.
+            static void set_thread_connection(basic_connection* connection);
+            static basic_connection* get_thread_connection();
+        };
+
+        // Sets the connection of the calling thread until destroyed.
+        class connection_scope
+        {
+        public:
+            connection_scope(basic_connection* connection);
+            ~connection_scope();
+            connection_scope(const connection_scope&) = delete;
+            connection_scope& operator=(const connection_scope&) = delete;
+        private:
+            basic_connection* m_previous;
+            static std::atomic<size_t> s_active;
+            static thread_local size_t s_thread_active;
+        public:
+            // Scopes alive in threads other than the calling one.
+            static size_t active_in_other_threads();
         };
 
         class sqlite3_connection : public basic_connection
         {
             public:
                 sqlite3_connection();
+                sqlite3_connection(detached_t);
                 sqlite3_connection(const std::filesystem::path& database_path);
                 ~sqlite3_connection();
             protected:
                 sqlite3 *m_database = nullptr;
                 std::filesystem::path m_database_path;
             public:
+                // A prepared statement with the decoders of its result columns. Kept by the connection while idle.
+                struct prepared_statement
+                {
+                    sqlite3_stmt* stmt = nullptr;
+                    size_t generation = 0;
+                    std::vector<std::string> columns_names;
+                    std::vector<var::var_type> columns_types;
+                    std::vector<column_decoder> decoders;
+                    ~prepared_statement();
+                };
+                // Maximum number of idle statements kept, keyed by their SQL.
+                size_t statement_cache_capacity = 256;
+            protected:
+                std::unordered_map<std::string, std::unique_ptr<prepared_statement>> m_statements;
+                std::mutex m_statements_mutex;
+                size_t m_statements_generation = 0;
+            public:
+                // Takes a statement out of the cache (or prepares it), so only one caller steps it at a time. Returns nullptr on error.
+                std::unique_ptr<prepared_statement> acquire_statement(const std::string& sql);
+                void release_statement(const std::string& sql, std::unique_ptr<prepared_statement> statement);
+                // Drops every cached statement, needed when the schema changes.
+                void clear_statements();
+                // Binds the bytes as a parameter, nothing is escaped or copied into the SQL.
+                void write_blob(table* table, const std::string& column, size_t id, const void* data, size_t size);
+                // Sets the column to a zero-filled blob of the given size, to be filled later with blob_stream.
+                void allocate_blob(table* table, const std::string& column, size_t id, size_t size);
+                // Copies up to size bytes starting at offset straight into buffer. Returns the number of bytes read.
+                size_t read_blob(table* table, const std::string& column, size_t id, void* buffer, size_t size, size_t offset = 0);
                 sqlite3* get_database() const { return m_database; }
+                static void update_hook(void* data, int operation, const char* database, const char* table_name, sqlite3_int64 rowid);
+                static int authorizer(void* data, int action, const char* table_name, const char* column, const char* database, const char* trigger);
                 virtual bool open() override;
                 virtual bool is_open() const override;
-                bool open(const std::filesystem::path& path);
+                // Without load_schema, the cached tables are left as they are (e.g. a copy of a database already read).
+                bool open(const std::filesystem::path& path, bool load_schema = true);
                 virtual bool create_table(const table* table) const override;
                 void alter_table(uva::database::table* table, const std::string& new_signature);
+            private:
+                void online_rebuild(uva::database::table* table, const std::string& new_signature, const std::string& columns);
+                // Installs the forwarding triggers, copies the rows into <table>_new and swaps the tables.
+                void copy_online(uva::database::table* table, const std::string& new_signature, const std::string& columns);
+            public:
                 virtual bool insert(table* table, size_t id, const std::map<std::string, std::string>& relations) override;
                 virtual bool insert(table* table, size_t id, const std::vector<std::map<std::string, std::string>>& relations) override;
                 virtual void update(size_t id, const std::string& key, const std::string& value, table* table) override;
                 virtual void destroy(size_t id, uva::database::table* table) override;
                 virtual void add_column(uva::database::table* table, const std::string& name, const std::string& type, const std::string& default_value) override;
                 virtual void change_column(uva::database::table* table, const std::string& name, const std::string& type) override;
+                virtual void read_schema(table* table) override;
+                virtual void load_schema() override;
                 virtual void begin_transaction() override;
                 virtual void end_transaction() override;
+                virtual void rollback_transaction() override;
         };
  
+        // Incremental I/O over a single blob value (sqlite3_blob_open), so large values never need to be loaded at once.
+        // The size of a blob cannot change, use sqlite3_connection::allocate_blob before writing a new value.
+        class blob_stream
+        {
+        public:
+            blob_stream(table* table, const std::string& column, size_t id, bool writable = false);
+            blob_stream(const blob_stream&) = delete;
+            ~blob_stream();
+        private:
+            sqlite3_blob* m_blob = nullptr;
+            table* m_table;
+            size_t m_id;
+            size_t m_offset = 0;
+        public:
+            size_t size() const;
+            size_t tell() const { return m_offset; }
+            void seek(size_t offset);
+            // Reads up to size bytes from the current offset. Returns the number of bytes read, 0 at the end.
+            size_t read(void* buffer, size_t size);
+            void write(const void* buffer, size_t size);
+            // Moves the stream to the same column of another row, cheaper than opening a new stream.
+            void reopen(size_t id);
+        };
+
+        // Test support. Migrates a database once and hands out isolated copies of it, so each test or context
+        // can run on its own database (and its own thread, through connection_scope) without cross-talk.
+        // Neither the template nor its clones become the default connection. Cached tables are shared by every
+        // connection, clones keep the schema read from the template instead of reading it again. Building a
+        // template writes that schema, so it throws while connection scopes are alive in other threads.
+        class template_database
+        {
+        public:
+            enum class clone_mode
+            {
+                // Copies the template file to the path given to clone().
+                file,
+                // sqlite3_backup of the template into a :memory: database.
+                backup,
+                // sqlite3_deserialize of an image taken after the migrations into a :memory: database. The fastest.
+                deserialize,
+            };
+        public:
+            // Opens (or creates) the template and runs the pending migrations on it. Build templates before
+            // starting the threads using their clones.
+            template_database(const std::filesystem::path& path);
+        private:
+            std::filesystem::path m_path;
+            std::unique_ptr<sqlite3_connection> m_connection;
+            std::vector<unsigned char> m_image;
+        public:
+            std::unique_ptr<sqlite3_connection> clone(clone_mode mode = clone_mode::deserialize, const std::filesystem::path& path = {}) const;
+            sqlite3_connection* get_connection() const { return m_connection.get(); }
+        };
+
+        // The current row of a statement being stepped. Nothing is copied: views are valid only until the callback returns.
+        class row_view
+        {
+        public:
+            row_view(sqlite3_stmt* stmt, const std::vector<std::string>& names);
+        private:
+            sqlite3_stmt* m_stmt;
+            const std::vector<std::string>* m_names;
+        public:
+            size_t size() const { return m_names->size(); }
+            const std::string& name(size_t column) const { return (*m_names)[column]; }
+            size_t index(std::string_view name) const;
+            bool is_null(size_t column) const;
+            std::string_view text(size_t column) const;
+            std::string_view blob(size_t column) const;
+            int64_t integer(size_t column) const;
+            double real(size_t column) const;
+            bool is_null(std::string_view name) const { return is_null(index(name)); }
+            std::string_view text(std::string_view name) const { return text(index(name)); }
+            std::string_view blob(std::string_view name) const { return blob(index(name)); }
+            int64_t integer(std::string_view name) const { return integer(index(name)); }
+            double real(std::string_view name) const { return real(index(name)); }
+        };
+
         using result = std::vector<std::pair<std::string, std::string>>;
         using results = std::vector<std::vector<std::pair<std::string, std::string>>>;
 
         extern std::map<std::string, var::var_type> sql_values_types_map;
-        const var::var_type& sql_delctype_to_value_type(const std::string& type);
+        var::var_type sql_delctype_to_value_type(const std::string& type);
 
         class active_record_relation
         {
@@ -192,31 +694,55 @@ namespace uva
             active_record_relation() = default;
             active_record_relation(table* table);
         private:
-            std::map<std::string, var> m_update;
-            std::string m_select;
-            std::string m_from;
-            std::string m_where;
-            std::string m_group;
-            std::string m_order;
-            std::string m_limit;
-            var m_insert = empty_array;
-            std::vector<std::string> m_columns;
-            std::string m_into;
-            std::string m_returning;
-            table* m_table;
+            // What the relation runs. Copies share it, the first change made through a shared copy clones it
+            // (copy on write), so building queries from Model::all() or passing relations around is cheap.
+            struct query
+            {
+                std::map<std::string, var> update;
+                std::string select;
+                std::string from;
+                std::string where;
+                std::string group;
+                std::string order;
+                std::string limit;
+                var insert = empty_array;
+                std::vector<std::string> columns;
+                std::string into;
+                std::string returning;
+                // Target of the query, also gives its default scope and primary key.
+                table* target = nullptr;
+                bool unscoped = false;
+            };
+            // Rows of the last commit. Every commit starts a new result set, so copies keep the rows
+            // they had without copying them.
+            struct result_set
+            {
+                std::vector<std::vector<var>> rows;
+                std::vector<std::string> columns_names;
+                std::vector<var::var_type> columns_types;
+            };
 
-            std::map<std::string, size_t> m_columnsIndexes;
-            std::vector<std::string> m_columnsNames;
-            std::vector<var::var_type> m_columnsTypes;
+            std::shared_ptr<query> m_query = empty_query();
+            std::shared_ptr<result_set> m_result;
 
+            statement_status m_status;
 
-            bool m_unscoped = false;
+            static const std::shared_ptr<query>& empty_query();
+            // The query, cloned first when another relation shares it.
+            query& edit();
+            // Starts the result set of a new commit.
+            result_set& reset_result();
         public:
-            std::vector<std::vector<var>> m_results;
+            // Rows of the last commit, empty before the first one.
+            const std::vector<std::vector<var>>& results() const;
             std::string to_sql() const;
+            // Counters of the last statement run by commit() or each_row().
+            const statement_status& status() const { return m_status; }
         public:
             void update(const std::map<std::string, var>& update);
             active_record_relation& select(const std::string& select);
+            // Selects the columns and the primary key of the table.
+            active_record_relation& only(const std::vector<std::string>& columns);
             active_record_relation& from(const std::string& from);
             template<class... Args>
             active_record_relation& where(const std::string where, Args... args)
@@ -250,11 +776,13 @@ namespace uva
             std::map<std::string, var> first();
             void each_with_index(std::function<void(std::map<std::string, var>&, const size_t&)> func);
             void each(std::function<void(std::map<std::string, var>&)> func);
+            // Runs the query once and calls func for every row without decoding it into vars.
+            void each_row(std::function<void(const row_view&)> func);
             template<class record>
             void each_with_index(std::function<void(record& value, const size_t&)>& func)
             {
                 each_with_index([&](std::map<std::string, var>& value, const size_t& index){
-                    record r(std::move(value));
+                    record r = make_record<record>(std::move(value));
                     func(r, index);
                 });
             }
@@ -262,7 +790,7 @@ namespace uva
             void each(std::function<void(record&)>& func)
             {
                 each([&](std::map<std::string, var>& value){
-                    record r(std::move(value));
+                    record r = make_record<record>(std::move(value));
                     func(r);
                 });
             }
@@ -286,6 +814,31 @@ namespace uva
             operator var();
         };
 
+        enum class cache_index_type
+        {
+            hash,
+            sorted,
+        };
+
+        // Orders cached values like SQLite does: empty (null) first, then numbers by value, then text.
+        // Values are only compared as numbers in the positions marked in numeric (columns with INTEGER,
+        // REAL or NUMERIC affinity), so text such as "1e5" or "nan" stays text.
+        struct cache_key_less
+        {
+            std::vector<bool> numeric;
+            bool operator()(const std::vector<std::string>& lhs, const std::vector<std::string>& rhs) const;
+        };
+
+        struct table_options
+        {
+            // Rows are stored in the primary key B-tree, so lookups by key don't need a second rowid lookup.
+            bool without_rowid = false;
+            // Values must match the declared column types.
+            bool strict = false;
+            // Composite (or non id) primary key, written as a PRIMARY KEY table constraint.
+            std::vector<std::string> primary_key;
+        };
+
         class table
         {
         public:
@@ -294,29 +847,105 @@ namespace uva
 
             std::string m_name;
             std::vector<std::pair<std::string, std::string>> m_columns;
+            // Filled from the database by basic_connection::read_schema, in the same order as m_columns.
+            std::vector<var::var_type> m_columns_types;
+            struct index_definition
+            {
+                std::string name;
+                bool unique = false;
+                bool partial = false;
+                std::vector<std::string> columns;
+                std::string sql;
+            };
+            std::vector<index_definition> m_indexes;
+            // Columns declared with GENERATED ALWAYS AS. They are read like any other column but never written.
+            std::set<std::string> m_generated_columns;
+            // Table constraints other than the primary key (UNIQUE, CHECK, FOREIGN KEY), as written. Kept by rebuilds.
+            std::vector<std::string> m_constraints;
+            bool m_without_rowid = false;
+            bool m_strict = false;
+            // Condition added to every query not marked as unscoped(). Unless the model declares one, it is
+            // removed = 0 when the table has a removed column and empty otherwise. Updated by read_schema.
+            std::string m_default_scope;
+            std::optional<std::string> m_declared_default_scope;
+            bool m_default_scope_declared = false;
+            void set_default_scope(const std::string& scope);
+            // Called by every model resolving the table, scope is null for the automatic one. Models sharing a
+            // table share its scope, so a model declaring a different one than the previous models throws.
+            void declare_default_scope(const char* scope);
+            void update_default_scope();
             std::map<size_t, std::map<std::string, std::string>> m_relations;
+            // Cached tables keep all their rows in m_relations. Rows changed in the database are marked as
+            // stale by sqlite3_connection::update_hook and reloaded on the next read. Hooks may come from any
+            // thread, so the stale set and the cached tables list are guarded by mutexes. m_relations itself
+            // is only synced and read by the thread using the table, one thread at a time. Rows deleted by a
+            // REPLACE conflict don't call the hook, the library never writes cached tables with REPLACE.
+            bool m_cached = false;
+            // The connection the rows were read from. Writes through other connections are ignored.
+            basic_connection* m_cache_connection = nullptr;
+            std::mutex m_stale_relations_mutex;
+            std::set<size_t> m_stale_relations;
+            void cache();
+            void load_relations();
+            void invalidate_relation(size_t id);
+            void sync_relations();
+            // Only accessed with get_cached_tables_mutex() locked.
+            static std::vector<table*>& get_cached_tables();
+            static std::mutex& get_cached_tables_mutex();
+            // Secondary indexes over m_relations, kept up to date on every load and sync.
+            struct cache_index
+            {
+                std::vector<std::string> columns;
+                cache_index_type type;
+                std::unordered_map<std::string, std::set<size_t>> hashed;
+                std::map<std::vector<std::string>, std::set<size_t>, cache_key_less> sorted;
+            };
+            std::vector<cache_index> m_cache_indexes;
+            void add_cache_index(const std::vector<std::string>& columns, cache_index_type type = cache_index_type::hash);
+            std::vector<size_t> find_range(const std::vector<std::string>& columns, const std::vector<std::string>& from, const std::vector<std::string>& to);
+        private:
+            void index_relation(size_t id, const std::map<std::string, std::string>& relation);
+            void unindex_relation(size_t id, const std::map<std::string, std::string>& relation);
+            void insert_relation(size_t id, std::map<std::string, std::string>&& relation);
+            void erase_relation(size_t id);
+        public:
             size_t create();
             size_t create(const std::map<std::string, var>& relations);
             void create(std::vector<std::map<std::string, var>>& relations);
             void create(std::vector<var>& relations, const std::vector<std::string>& columns);
             void create(var& relations, const std::vector<std::string>& columns);
             void create(std::vector<std::vector<var>>& relations, const std::vector<std::string>& columns);
-            size_t find(size_t id) const;
+            size_t find(size_t id);
             size_t find_by(const std::map<std::string, std::string>& relations);
             size_t first();
             size_t last();
+            // Comma separated primary key columns, empty for tables keyed by rowid only.
             std::string primary_key;
+            // Columns identifying a row, "id" unless the table declares another primary key.
+            std::vector<std::string> primary_key_columns() const;
+            // "name(columns, constraints) options", as used by CREATE TABLE. extra_columns are appended to the columns.
+            std::string definition(const std::vector<std::pair<std::string, std::string>>& extra_columns = {}) const;
+            // Inserts the row, or updates it when a row with the same primary key exists.
+            void upsert(const std::map<std::string, var>& values);
             void destroy(size_t id);
-            bool relation_exists(size_t id) const;
+            bool relation_exists(size_t id);
             void update(size_t id, const std::string& key, const std::string& value);
             void update(size_t id, const std::map<std::string, var>& value);
-            static std::map<std::string, table*>& get_tables();
+            // "a = 1 AND b = 'x'" for the primary key columns of row. Throws if row misses one of them.
+            std::string key_condition(const std::map<std::string, var>& row) const;
+            // Update and delete the row identified by the primary key values of row, for any primary key.
+            void update_row(const std::map<std::string, var>& row, const std::map<std::string, var>& values);
+            void destroy_row(const std::map<std::string, var>& row);
+            // Every table is registered once by its constructor. Lookups take a shared lock, registration an exclusive one.
+            static std::unordered_map<std::string, table*>& get_tables();
             static table* get_table(const std::string& name);
+            static table* find_table(const std::string& name);
             std::string& at(size_t id, const std::string& key);
             void add_column(const std::string& name, const std::string& type, const std::string& default_value);
             void change_column(const std::string& name, const std::string& type);
             std::vector<std::pair<std::string, std::string>>::const_iterator find_column(const std::string& col) const;
             std::vector<std::pair<std::string, std::string>>::iterator find_column(const std::string& col);
+            const var::var_type& column_type(const std::string& col) const;
             static void add_table(uva::database::table* table);
         };
         class basic_active_record_column : public var
@@ -351,6 +980,13 @@ namespace uva
         public:
             bool present() const;
             void destroy();            
+            // Null for the automatic default scope: removed = 0 on tables with a removed column. See uva_database_default_scope.
+            static const char* default_scope() { return nullptr; }
+            static bool selects_exposed_columns() { return false; }
+            // Exposed columns which belong to the table, after the primary key columns.
+            std::vector<std::string> exposed_columns() const;
+            // Set for records read from the database. at() then loads the columns the query didn't select.
+            bool m_lazy_columns = false;
         protected:
             virtual const table* get_table() const = 0;
             virtual table* get_table() = 0;
@@ -370,6 +1006,10 @@ namespace uva
             const var& at(const std::string& str) const;
 
             void save();
+            // Reads the record again by its primary key.
+            void reload();
+            // Reads the columns of the table missing from values, in a single query.
+            void load_missing_columns();
             void update(const std::string& col, const var& value);
             void update(const std::map<std::string, var>& values);
 
@@ -382,6 +1022,28 @@ namespace uva
             var& operator[](const std::string& str);
             const var& operator[](const std::string& str) const;
         };
+        // Rows covered by an index.
+        enum class index_scope
+        {
+            all_rows,
+            // Only rows in the table default scope (e.g. removed = 0). Every scoped query filters on it, so
+            // they can use the index and soft-deleted rows don't take space in it. The scope is the one known
+            // when the migration runs: a scope declared by a model is only known after its table() was called.
+            default_scope,
+        };
+
+        struct index_options
+        {
+            bool unique = false;
+            index_scope scope = index_scope::all_rows;
+            // Extra columns appended to the key so queries selecting them never read the table (covering index).
+            std::vector<std::string> include;
+            // Partial index condition, combined with the default scope for index_scope::default_scope.
+            std::string where;
+            // Defaults to idx_<table>_on_<columns>.
+            std::string name;
+        };
+
         class basic_migration : public basic_active_record
         {
         uva_database_declare(basic_migration);
@@ -398,13 +1060,21 @@ namespace uva
         public:
             static std::vector<basic_migration*>& get_migrations();
             static void do_pending_migrations();
+            // Writes the current schema (tables, indexes, views and triggers) and the applied migrations as SQL.
+            static void dump_schema(const std::filesystem::path& path);
+            // Runs a file written by dump_schema in a single transaction. Existing objects are kept.
+            static void load_schema_snapshot(const std::filesystem::path& path);
+            // Loads the snapshot into an empty database, then runs the migrations newer than it.
+            static void bootstrap(const std::filesystem::path& schema);
         protected:
             void call_change();
         public:
-            void add_table(const std::string& table_name, const std::vector<std::pair<std::string, std::string>>& cols);
+            void add_table(const std::string& table_name, const std::vector<std::pair<std::string, std::string>>& cols, const table_options& options = {});
             void drop_table(const std::string& table_name);
             void add_column(const std::string& table_name, const std::string& name, const std::string& type, const std::string& default_value) const;
-            void add_index(const std::string& table_name, const std::string& column);
+            static void add_index(const std::string& table_name, const std::string& column);
+            // columns is a comma separated list of columns or expressions, e.g. "code, lower(name)".
+            static void add_index(const std::string& table_name, const std::string& columns, const index_options& options);
             void change_column(const std::string& table_name, const std::string& name, const std::string& type) const;
         };
     };
@@ -1,5 +1,12 @@
 #include <database.hpp>
 
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <ctime>
+#include <limits>
+
 // STATIC MEMBERS
 
 std::map<std::string, var::var_type> uva::database::sql_values_types_map 
@@ -8,9 +15,11 @@ std::map<std::string, var::var_type> uva::database::sql_values_types_map
     { "TEXT", var::var_type::string },
     { "INTEGER", var::var_type::integer },
     { "REAL", var::var_type::real },
+    // There is no binary var type, blobs are read as strings holding the raw bytes.
+    { "BLOB", var::var_type::string },
 };
 
-const var::var_type& uva::database::sql_delctype_to_value_type(const std::string& type)
+var::var_type uva::database::sql_delctype_to_value_type(const std::string& type)
 {
     auto it = sql_values_types_map.find(type);
 
@@ -19,550 +28,2972 @@ const var::var_type& uva::database::sql_delctype_to_value_type(const std::string
         return it->second;
     }
 
-    throw std::runtime_error(std::format("failed to convert from '{}' to value_type", type));
+    switch(sql_type_affinity(type.c_str()))
+    {
+        case column_affinity::integer:
+        // SQLite stores NUMERIC values as integers whenever the conversion is lossless.
+        case column_affinity::numeric:
+            return var::var_type::integer;
+        case column_affinity::real:
+            return var::var_type::real;
+        default:
+            return var::var_type::string;
+    }
 }
 
-
-void uva::database::within_transaction(std::function<void()> __f)
+uva::database::column_affinity uva::database::sql_type_affinity(const char* declared_type)
 {
-    uva::database::basic_connection::get_connection()->begin_transaction();
-    try {
-        __f();
-    } catch(std::exception e)
-    {
-        uva::database::basic_connection::get_connection()->end_transaction();    
-        throw;
+    if(!declared_type || !*declared_type) {
+        return column_affinity::blob;
     }
-    uva::database::basic_connection::get_connection()->end_transaction();
-}
 
+    std::string type = declared_type;
+    std::transform(type.begin(), type.end(), type.begin(), ::toupper);
 
-size_t uva::database::query_buffer_lenght = uva::database::query_buffer_lenght_default;
-bool   uva::database::enable_query_cout_printing = uva::database::enable_query_cout_printing_default;
+    // The rules are applied in this order, so VARCHAR is text and "CHARINT" is integer.
+    if(type.find("INT") != std::string::npos) {
+        return column_affinity::integer;
+    }
 
-// END STATIC MEMBERS
+    if(type.find("CHAR") != std::string::npos || type.find("CLOB") != std::string::npos || type.find("TEXT") != std::string::npos) {
+        return column_affinity::text;
+    }
 
-using basic_migration = uva::database::basic_migration;
-uva_database_define_full(basic_migration, "database_migrations");
+    if(type.find("BLOB") != std::string::npos) {
+        return column_affinity::blob;
+    }
 
-//BASIC CONNECTION
+    if(type.find("REAL") != std::string::npos || type.find("FLOA") != std::string::npos || type.find("DOUB") != std::string::npos) {
+        return column_affinity::real;
+    }
 
-uva::database::basic_connection* uva::database::basic_connection::s_connection = nullptr;
+    return column_affinity::numeric;
+}
 
-uva::database::basic_connection::basic_connection()
+// Decodes a value by its storage class. Used for columns without a fixed affinity and for values
+// stored with a class other than the column affinity (e.g. text in an INTEGER column).
+static void decode_value(sqlite3_stmt* stmt, int column, int storage_class, std::vector<var>& row)
 {
-    s_connection = this;
+    switch(storage_class)
+    {
+        case SQLITE_INTEGER:
+            row.emplace_back((int64_t)sqlite3_column_int64(stmt, column));
+            break;
+        case SQLITE_FLOAT:
+            row.emplace_back(sqlite3_column_double(stmt, column));
+            break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB:
+        {
+            // Text must be read before asking for its size.
+            const char* value = storage_class == SQLITE_TEXT ? (const char*)sqlite3_column_text(stmt, column) : (const char*)sqlite3_column_blob(stmt, column);
+            int bytes = sqlite3_column_bytes(stmt, column);
+            row.emplace_back(std::string(value ? value : "", bytes));
+            break;
+        }
+        default:
+            row.emplace_back(null);
+            break;
+    }
 }
 
-uva::database::basic_connection* uva::database::basic_connection::get_connection()
+static void decode_dynamic(sqlite3_stmt* stmt, int column, std::vector<var>& row)
 {
-    return s_connection;
+    decode_value(stmt, column, sqlite3_column_type(stmt, column), row);
 }
 
-//SQLITE3 CONNECTION
-
-uva::database::sqlite3_connection::sqlite3_connection(const std::filesystem::path& database_path)
-    : m_database_path(database_path)
+static void decode_integer(sqlite3_stmt* stmt, int column, std::vector<var>& row)
 {
-    open();
+    int storage_class = sqlite3_column_type(stmt, column);
+
+    if(storage_class != SQLITE_INTEGER) {
+        decode_value(stmt, column, storage_class, row);
+        return;
+    }
+
+    row.emplace_back((int64_t)sqlite3_column_int64(stmt, column));
 }
 
-uva::database::sqlite3_connection::~sqlite3_connection()
+static void decode_real(sqlite3_stmt* stmt, int column, std::vector<var>& row)
 {
-    sqlite3_close(m_database);
+    int storage_class = sqlite3_column_type(stmt, column);
+
+    // Integral values in REAL columns are stored as integers but are still reals.
+    if(storage_class != SQLITE_FLOAT && storage_class != SQLITE_INTEGER) {
+        decode_value(stmt, column, storage_class, row);
+        return;
+    }
+
+    row.emplace_back(sqlite3_column_double(stmt, column));
 }
 
-bool uva::database::sqlite3_connection::open()
+static void decode_text(sqlite3_stmt* stmt, int column, std::vector<var>& row)
 {
-    std::filesystem::path folder = m_database_path.parent_path();
-    if (!std::filesystem::exists(folder)) {
-        if (!std::filesystem::create_directories(folder)) {
-            throw std::runtime_error("unknow error while creating databse directories.");
-        }
-    }
-    int error = sqlite3_open(m_database_path.string().c_str(), &m_database);    
-    if (error) {        
-        throw std::runtime_error("unknow error while opening database.");
+    int storage_class = sqlite3_column_type(stmt, column);
+
+    if(storage_class != SQLITE_TEXT) {
+        decode_value(stmt, column, storage_class, row);
+        return;
     }
-    return m_database;
+
+    const char* value = (const char*)sqlite3_column_text(stmt, column);
+    int bytes = sqlite3_column_bytes(stmt, column);
+    row.emplace_back(std::string(value, bytes));
 }
 
-bool uva::database::sqlite3_connection::open(const std::filesystem::path& path)
+uva::database::column_decoder uva::database::sql_column_decoder(column_affinity affinity)
 {
-    m_database_path = path;
-    int error = sqlite3_open(m_database_path.string().c_str(), &m_database);
-    if (error) {
-        throw std::runtime_error("unknow error while opening databse.");
+    switch(affinity)
+    {
+        case column_affinity::integer:
+            return &decode_integer;
+        case column_affinity::real:
+            return &decode_real;
+        case column_affinity::text:
+            return &decode_text;
+        default:
+            return &decode_dynamic;
     }
-    return m_database;
 }
 
-bool uva::database::sqlite3_connection::create_table(const uva::database::table* table) const
+
+void uva::database::within_transaction(std::function<void()> __f)
 {
-    std::string error_report;
-    std::string sql;
+    uva::database::basic_connection::get_connection()->begin_transaction();
+    try {
+        __f();
+    } catch(...)
+    {
+        uva::database::basic_connection::get_connection()->rollback_transaction();
+        throw;
+    }
+    uva::database::basic_connection::get_connection()->end_transaction();
+}
 
-    auto elapsed = uva::diagnostics::measure_function([&]{
-        /* Create SQL statement */
 
-        sql = "CREATE TABLE IF NOT EXISTS " + table->m_name + "(";
+size_t uva::database::query_buffer_lenght = uva::database::query_buffer_lenght_default;
+bool   uva::database::enable_query_cout_printing = uva::database::enable_query_cout_printing_default;
+size_t uva::database::each_batch_size = uva::database::each_batch_size_default;
+bool   uva::database::enable_online_rebuild = uva::database::enable_online_rebuild_default;
+size_t uva::database::online_rebuild_chunk_size = uva::database::online_rebuild_chunk_size_default;
 
-        for(const auto& col : table->m_columns)
-        {
-            sql += col.first + " " + col.second + ", ";
-        }
+// END STATIC MEMBERS
 
-        sql.pop_back();
-        sql.pop_back();
+//LOGGER
 
-        sql += " );";
+bool uva::database::basic_logger::should_log(log_level record_level)
+{
+    if(record_level < level.load(std::memory_order_relaxed)) {
+        return false;
+    }
 
-        /* Execute SQL statement */
+    size_t rate = sample_rate.load(std::memory_order_relaxed);
 
-        char* error_msg = nullptr;
-        int error = sqlite3_exec(m_database, sql.c_str(),
-            [](void *NotUsed, int columnCount, char **columnValue, char **value) {
-            return 0;
-        }, 0, &error_msg);
+    if(record_level >= log_level::warning || rate <= 1) {
+        return true;
+    }
 
-        if (error) {
-            error_report = error_msg;
-            sqlite3_free(error_msg);
-        }
-    });
+    return m_sampled.fetch_add(1, std::memory_order_relaxed) % rate == 0;
+}
 
+void uva::database::cout_logger::log(log_record&& record)
+{
     uva::console::color_code color_code;
 
-    if(error_report.empty()) {
-        color_code = uva::console::color_code::blue;
+    if(record.error.empty()) {
+        color_code = record.level >= log_level::warning ? uva::console::color_code::yellow : uva::console::color_code::blue;
     } else {
         color_code = uva::console::color_code::red;
     }
 
     #ifdef USE_FMT_FORMT
-        std::string result = std::format("({} ms) {}", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), sql);
+        std::string result = std::format("({} ms) {}", std::chrono::duration_cast<std::chrono::milliseconds>(record.elapsed).count(), record.sql);
     #else
-        std::string result = std::format("({}) {}", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed), sql);
+        std::string result = std::format("({}) {}", std::chrono::duration_cast<std::chrono::milliseconds>(record.elapsed), record.sql);
     #endif
 
-    std::cout << uva::console::color(color_code) << result << std::endl;
+    std::cout << uva::console::color(color_code) << result << '\n';
 
-    if(!error_report.empty()) {
-        std::cout << uva::console::color(uva::console::color_code::red) << error_report << std::endl;
-        throw std::runtime_error(error_report);
+    if(!record.error.empty()) {
+        std::cout << uva::console::color(uva::console::color_code::red) << record.error << '\n';
     }
 
-    return true;
+    if(!record.plan.empty()) {
+        std::cout << uva::console::color(uva::console::color_code::yellow) << record.plan;
+    }
 }
 
-void uva::database::sqlite3_connection::alter_table(uva::database::table* table, const std::string& new_signature)
+void uva::database::cout_logger::flush()
 {
-    std::string cols = "ID";
+    std::cout.flush();
+}
 
-    for (const auto& row : table->m_columns)
-    {
-        cols += ", " + row.first;
+uva::database::async_logger::async_logger(std::shared_ptr<basic_logger> sink, size_t capacity)
+    : m_sink(std::move(sink))
+{
+    size_t size = 1;
+
+    while(size < capacity) {
+        size <<= 1;
     }
 
-    std::string oldTableName = table->m_name + "_old";
+    m_cells = std::make_unique<cell[]>(size);
+    m_mask = size - 1;
 
-    char* error_msg = nullptr;
-    std::string sql =
+    for(size_t i = 0; i < size; ++i) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
 
-        "PRAGMA foreign_keys = off;"
-        "BEGIN TRANSACTION;"
-        "ALTER TABLE " + table->m_name + " RENAME TO " + oldTableName + ";"
-        "CREATE TABLE " + new_signature + ";"
-        "INSERT INTO " + table->m_name + " (" + cols + ") SELECT " + cols + " FROM " + oldTableName + ";"
-        "DROP TABLE " + oldTableName + ";"
-        "COMMIT; "
-        "PRAGMA foreign_keys = on;";
+    m_thread = std::thread(&async_logger::run, this);
+}
 
-    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);
-    if (error) {
-        std::string error_report = error_msg;
-        sqlite3_free(error_msg);
-        throw std::runtime_error(error_report);
-    }
+uva::database::async_logger::~async_logger()
+{
+    m_stopping = true;
+    m_condition.notify_one();
+    m_thread.join();
 }
 
-bool uva::database::sqlite3_connection::insert(table* table, size_t id, const std::map<std::string, std::string>& relations) {
-    char* error_msg = nullptr;
-    std::string sql = "INSERT INTO " + table->m_name + " VALUES(" + std::to_string(id);
-    
-    for(const auto& col : table->m_columns) {
-        sql += ", \"";
-        auto it = relations.find(col.first);
-        if(it != relations.end()) {
-            if (col.second == "TEXT") {
-                sql.reserve(sql.size() + it->second.size());
-                for (const char& c : it->second) {
-                    if (c == '\"') {
-                        sql.push_back('\"');
-                    }
-                    sql.push_back(c);
-                }                
-            }
-            else {
-                sql += it->second;
+void uva::database::async_logger::log(log_record&& record)
+{
+    // Bounded multi-producer queue: a cell is free when its sequence equals the position being claimed.
+    size_t position = m_enqueue_position.load(std::memory_order_relaxed);
+
+    while(true) {
+        cell& current = m_cells[position & m_mask];
+        size_t sequence = current.sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if(difference == 0) {
+            if(m_enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                current.record = std::move(record);
+                current.sequence.store(position + 1, std::memory_order_release);
+                break;
             }
+        } else if(difference < 0) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            position = m_enqueue_position.load(std::memory_order_relaxed);
         }
-        sql += "\"";
     }
-    
-    sql += ");";
-    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);
-            
-    if (error) {
-        std::string error_report = error_msg;
-        sqlite3_free(error_msg);
-        throw std::runtime_error(error_report);
+
+    if(m_idle.load(std::memory_order_relaxed)) {
+        m_condition.notify_one();
     }
+}
+
+bool uva::database::async_logger::pop(log_record& record)
+{
+    cell& current = m_cells[m_dequeue_position & m_mask];
+
+    if(current.sequence.load(std::memory_order_acquire) != m_dequeue_position + 1) {
+        return false;
+    }
+
+    record = std::move(current.record);
+    current.sequence.store(m_dequeue_position + m_mask + 1, std::memory_order_release);
+    ++m_dequeue_position;
+
     return true;
 }
 
-bool uva::database::sqlite3_connection::insert(table* table, size_t id, const std::vector<std::map<std::string, std::string>>& relations)
+void uva::database::async_logger::run()
 {
-    //todo: merge those functions
-    char* error_msg = nullptr;
-    std::string sql = "INSERT INTO " + table->m_name + " VALUES\n";
-        
-    for (const auto& relation : relations) {
-        sql += "(" + std::to_string(id++);
-        for (const auto& col : table->m_columns) {
-            sql += ", \"";
-            auto it = relation.find(col.first);
-            if (it != relation.end()) {
-                if (col.second == "TEXT") {
-                    sql.reserve(sql.size() + it->second.size());
-                    for (const char& c : it->second) {
-                        if (c == '\"') {
-                            sql.push_back('\"');
-                        }
-                        sql.push_back(c);
-                    }
-                }
-                else {
-                    sql += it->second;
-                }
-            }
-            sql += "\"";
+    log_record record;
+
+    while(true) {
+        size_t written = 0;
+
+        while(pop(record)) {
+            m_sink->log(std::move(record));
+            ++written;
         }
-        sql += "),\n";
+
+        if(written) {
+            m_sink->flush();
+            m_written.fetch_add(written, std::memory_order_release);
+            continue;
+        }
+
+        if(m_stopping) {
+            return;
+        }
+
+        // Producers only notify while the thread is idle, the timeout covers a notification sent right before.
+        std::unique_lock lock(m_mutex);
+        m_idle = true;
+        m_condition.wait_for(lock, std::chrono::milliseconds(50));
+        m_idle = false;
     }
+}
 
-    sql[sql.size() - 2] = ';';
-    
-    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);
+void uva::database::async_logger::flush()
+{
+    size_t target = m_enqueue_position.load(std::memory_order_acquire);
 
-    if (error) {
-        std::string error_report = error_msg;
-        sqlite3_free(error_msg);
-        throw std::runtime_error(error_report);
+    while(m_written.load(std::memory_order_acquire) < target) {
+        m_condition.notify_one();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
-    return true;
 }
 
-bool uva::database::sqlite3_connection::is_open() const
+static std::atomic<std::shared_ptr<uva::database::basic_logger>>& logger_storage()
 {
-    return m_database;
+    static std::atomic<std::shared_ptr<uva::database::basic_logger>> s_logger(
+        std::make_shared<uva::database::async_logger>(std::make_shared<uva::database::cout_logger>())
+    );
+
+    return s_logger;
 }
 
-void uva::database::sqlite3_connection::update(size_t id, const std::string& key, const std::string& value, uva::database::table* table) {
-    char* error_msg = nullptr;
-    std::string sql = "UPDATE " + table->m_name + " SET " + key + " = '" + value + "' where id = " + std::to_string(id);    
-    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);    
-    if (error) {
-        std::string error_report = error_msg;
-        sqlite3_free(error_msg);
-        throw std::runtime_error(error_report);
-    }
+std::shared_ptr<uva::database::basic_logger> uva::database::get_logger()
+{
+    return logger_storage().load();
 }
 
-void uva::database::sqlite3_connection::destroy(size_t id, uva::database::table* table)
+void uva::database::set_logger(std::shared_ptr<basic_logger> logger)
 {
-    char* error_msg = nullptr;
-    std::string sql = "DELETE FROM " + table->m_name + " where id = " + std::to_string(id);    
-    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);    
-    if (error) {
-        std::string error_report = error_msg;
-        sqlite3_free(error_msg);
-        throw std::runtime_error(error_report);
+    std::shared_ptr<basic_logger> previous = logger_storage().exchange(std::move(logger));
+
+    if(previous) {
+        previous->flush();
     }
 }
 
-void uva::database::sqlite3_connection::add_column(uva::database::table* table, const std::string& name, const std::string& type, const std::string& default_value)
+//STATEMENT STATUS
+
+uva::database::statement_status& uva::database::statement_status::operator+=(const statement_status& other)
 {
-    std::string cols_definitions = "ID INT PRIMARY KEY NOT NULL";
+    fullscan_steps += other.fullscan_steps;
+    sorts          += other.sorts;
+    autoindexes    += other.autoindexes;
+    vm_steps       += other.vm_steps;
+    reprepares     += other.reprepares;
+    memused         = std::max(memused, other.memused);
 
-    for (const auto& row : table->m_columns)
-    {
-        cols_definitions += ", " + row.first + " " + row.second;
-    }
+    return *this;
+}
 
-    cols_definitions += ", " + name + " " + type + " DEFAULT \"" + default_value + "\"";
+// Counters are reset so the next run of a cached statement starts from zero.
+static uva::database::statement_status read_statement_status(sqlite3_stmt* stmt)
+{
+    uva::database::statement_status status;
 
-    std::string new_definition = table->m_name + "(" + cols_definitions + ")";
+    status.fullscan_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    status.sorts          = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+    status.autoindexes    = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+    status.vm_steps       = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    status.reprepares     = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 1);
+    status.memused        = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
 
-    alter_table(table, new_definition);
+    return status;
+}
 
-    for (auto it = table->m_relations.begin(); it != table->m_relations.end(); ++it) {
-        it->second.insert({ name, default_value });
-    }
+static std::shared_mutex s_autoindex_hook_mutex;
+static uva::database::autoindex_hook s_autoindex_hook;
+
+uva::database::autoindex_hook uva::database::get_autoindex_hook()
+{
+    std::shared_lock lock(s_autoindex_hook_mutex);
+    return s_autoindex_hook;
 }
 
-void uva::database::sqlite3_connection::change_column(uva::database::table* table, const std::string& name, const std::string& type)
+void uva::database::set_autoindex_hook(autoindex_hook hook)
 {
-    std::string cols_definitions = "ID INT PRIMARY KEY NOT NULL";
+    std::unique_lock lock(s_autoindex_hook_mutex);
+    s_autoindex_hook = std::move(hook);
+}
+
+//END STATEMENT STATUS
+
+//SLOW QUERY LOG
+
+std::chrono::milliseconds uva::database::slow_query_threshold = uva::database::slow_query_threshold_default;
+std::filesystem::path uva::database::slow_query_log_path;
+
+static std::mutex s_slow_query_log_mutex;
+
+std::string uva::database::explain_query_plan(const std::string& sql)
+{
+    sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+
+    std::string explain = "EXPLAIN QUERY PLAN " + sql;
+    sqlite3_stmt* stmt = nullptr;
+
+    // Statements like BEGIN or PRAGMA have no plan, they simply fail to prepare.
+    if(sqlite3_prepare_v2(connection->get_database(), explain.c_str(), (int)explain.size(), &stmt, nullptr)) {
+        return std::string();
+    }
+
+    std::string plan;
+    std::map<int, size_t> depths;
+
+    // id, parent, notused, detail
+    while(sqlite3_step(stmt) == SQLITE_ROW) {
+        int id     = sqlite3_column_int(stmt, 0);
+        int parent = sqlite3_column_int(stmt, 1);
+
+        auto it = depths.find(parent);
+        size_t depth = it != depths.end() ? it->second + 1 : 0;
+        depths[id] = depth;
+
+        const unsigned char* detail = sqlite3_column_text(stmt, 3);
+
+        plan += std::string(depth * 2, ' ');
+        plan += detail ? (const char*)detail : "";
+        plan.push_back('\n');
+    }
+
+    sqlite3_finalize(stmt);
+
+    return plan;
+}
+
+static void report_slow_query(const std::string& sql, std::chrono::nanoseconds elapsed, size_t rows)
+{
+    uva::database::log_record record;
+    record.level   = uva::database::log_level::warning;
+    record.elapsed = elapsed;
+    record.sql     = sql.size() > 1000 ? sql.substr(0, 1000) : sql;
+    record.rows    = rows;
+    record.plan    = uva::database::explain_query_plan(sql);
+
+    if(!uva::database::slow_query_log_path.empty()) {
+        std::lock_guard lock(s_slow_query_log_mutex);
+
+        std::ofstream file(uva::database::slow_query_log_path, std::ios::app);
+
+        if(file.is_open()) {
+            std::time_t now = std::time(nullptr);
+
+            file << "# " << std::put_time(std::localtime(&now), "%F %T")
+                 << " (" << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << " ms, " << rows << " rows)\n"
+                 << sql << '\n'
+                 << record.plan << '\n';
+        }
+    }
+
+    std::shared_ptr<uva::database::basic_logger> logger = uva::database::get_logger();
+
+    if(logger->should_log(record.level)) {
+        logger->log(std::move(record));
+    }
+}
+
+//END SLOW QUERY LOG
+
+static thread_local size_t s_thread_queries = 0;
+
+size_t uva::database::thread_queries()
+{
+    return s_thread_queries;
+}
+
+// Set by begin_transaction, queries of the transaction are logged at trace instead of debug.
+static thread_local bool s_thread_in_transaction = false;
+
+// Logs the query and throws if it failed. Nothing is built when the logger discards the record.
+static void report_query(const std::string& sql, std::chrono::nanoseconds elapsed, const std::string& error_report, size_t rows = 0, const uva::database::statement_status& status = {})
+{
+    ++s_thread_queries;
+
+    if(uva::database::enable_query_statistics) {
+        uva::database::record_query_statistics(sql, elapsed, rows, status);
+    }
+
+    if(status.autoindexes) {
+        if(uva::database::autoindex_hook hook = uva::database::get_autoindex_hook()) {
+            hook(sql, status);
+        }
+    }
+
+    bool slow = error_report.empty() && uva::database::slow_query_threshold.count() && elapsed >= uva::database::slow_query_threshold;
+
+    if(slow) {
+        report_slow_query(sql, elapsed, rows);
+    } else if(uva::database::enable_query_cout_printing)
+    {
+        uva::database::log_level level = uva::database::log_level::error;
+
+        if(error_report.empty()) {
+            level = s_thread_in_transaction ? uva::database::log_level::trace : uva::database::log_level::debug;
+        }
+
+        std::shared_ptr<uva::database::basic_logger> logger = uva::database::get_logger();
+
+        if(logger->should_log(level)) {
+            uva::database::log_record record;
+            record.level   = level;
+            record.elapsed = elapsed;
+            record.sql     = sql.size() > 1000 ? sql.substr(0, 1000) : sql;
+            record.error   = error_report;
+            record.rows    = rows;
+
+            logger->log(std::move(record));
+        }
+    }
+
+    if(!error_report.empty()) {
+        throw std::runtime_error(error_report);
+    }
+}
+
+//END LOGGER
+
+//QUERY STATISTICS
+
+bool uva::database::enable_query_statistics = uva::database::enable_query_statistics_default;
+
+static std::mutex s_query_statistics_mutex;
+
+static std::unordered_map<std::string, uva::database::query_statistics>& query_statistics_storage()
+{
+    static std::unordered_map<std::string, uva::database::query_statistics> s_query_statistics;
+    return s_query_statistics;
+}
+
+std::string uva::database::normalize_sql(const std::string& sql)
+{
+    std::string shape;
+    shape.reserve(sql.size());
+
+    auto is_identifier = [](char c) {
+        return isalnum((unsigned char)c) || c == '_' || c == '$';
+    };
+
+    for(size_t i = 0; i < sql.size(); ++i) {
+        char c = sql[i];
+
+        if(c == '\'') {
+            // '' is an escaped quote inside the literal.
+            ++i;
+            while(i < sql.size() && !(sql[i] == '\'' && (i + 1 >= sql.size() || sql[i + 1] != '\''))) {
+                i += sql[i] == '\'' ? 2 : 1;
+            }
+            shape.push_back('?');
+        } else if(isdigit((unsigned char)c) && (shape.empty() || !is_identifier(shape.back()))) {
+            while(i + 1 < sql.size() && (is_identifier(sql[i + 1]) || sql[i + 1] == '.')) {
+                ++i;
+            }
+            shape.push_back('?');
+        } else if(isspace((unsigned char)c)) {
+            if(!shape.empty() && shape.back() != ' ') {
+                shape.push_back(' ');
+            }
+        } else {
+            shape.push_back(c);
+        }
+    }
+
+    // Lists of values (IN (?, ?, ?), VALUES (?,?),(?,?)) have the same shape whatever their length.
+    auto collapse = [&shape](const std::string& repeated, const std::string& single) {
+        size_t position = 0;
+        while((position = shape.find(repeated, position)) != std::string::npos) {
+            shape.replace(position, repeated.size(), single);
+        }
+    };
+
+    collapse("?, ?", "?");
+    collapse("?,?", "?");
+    collapse("(?), (?)", "(?)");
+    collapse("(?),(?)", "(?)");
+
+    return shape;
+}
+
+std::chrono::nanoseconds uva::database::query_statistics::mean() const
+{
+    return calls ? total / (int64_t)calls : std::chrono::nanoseconds::zero();
+}
+
+std::chrono::nanoseconds uva::database::query_statistics::percentile(double percentile) const
+{
+    size_t target = (size_t)std::ceil(calls * percentile / 100.0);
+    size_t accumulated = 0;
+
+    for(size_t bucket = 0; bucket < histogram.size(); ++bucket) {
+        accumulated += histogram[bucket];
+        if(accumulated >= target && accumulated) {
+            return std::chrono::microseconds(1ull << bucket);
+        }
+    }
+
+    return std::chrono::microseconds(1ull << (histogram.size() - 1));
+}
+
+void uva::database::record_query_statistics(const std::string& sql, std::chrono::nanoseconds elapsed, size_t rows, const statement_status& status)
+{
+    std::string shape = normalize_sql(sql);
+
+    // Bucket i holds latencies below 2^i microseconds.
+    size_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    size_t bucket = 0;
+
+    while(bucket + 1 < query_statistics::buckets && (1ull << bucket) <= microseconds) {
+        ++bucket;
+    }
+
+    std::lock_guard lock(s_query_statistics_mutex);
+
+    query_statistics& statistics = query_statistics_storage()[shape];
+
+    if(statistics.shape.empty()) {
+        statistics.shape = std::move(shape);
+    }
+
+    statistics.calls     += 1;
+    statistics.total     += elapsed;
+    statistics.rows      += rows;
+    statistics.sql_bytes += sql.size();
+    statistics.status    += status;
+    statistics.histogram[bucket] += 1;
+}
+
+std::vector<uva::database::query_statistics> uva::database::get_query_statistics()
+{
+    std::vector<query_statistics> statistics;
+
+    {
+        std::lock_guard lock(s_query_statistics_mutex);
+
+        statistics.reserve(query_statistics_storage().size());
+
+        for(const auto& shape : query_statistics_storage()) {
+            statistics.push_back(shape.second);
+        }
+    }
+
+    std::sort(statistics.begin(), statistics.end(), [](const query_statistics& lhs, const query_statistics& rhs) {
+        return lhs.total > rhs.total;
+    });
+
+    return statistics;
+}
+
+void uva::database::reset_query_statistics()
+{
+    std::lock_guard lock(s_query_statistics_mutex);
+    query_statistics_storage().clear();
+}
+
+static std::string json_escape(const std::string& value)
+{
+    std::string escaped;
+    escaped.reserve(value.size());
+
+    for(const char& c : value) {
+        switch(c)
+        {
+            case '"':  escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if((unsigned char)c < 0x20) {
+                    escaped += std::format("\\u{:04x}", (int)c);
+                } else {
+                    escaped.push_back(c);
+                }
+            break;
+        }
+    }
+
+    return escaped;
+}
+
+void uva::database::dump_query_statistics(const std::filesystem::path& path)
+{
+    std::ofstream file(path);
+
+    if(!file.is_open()) {
+        throw std::runtime_error(std::format("unable to open {} to dump query statistics", path.string()));
+    }
+
+    auto to_us = [](std::chrono::nanoseconds duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    };
+
+    std::vector<query_statistics> statistics = get_query_statistics();
+
+    file << "[\n";
+
+    for(size_t i = 0; i < statistics.size(); ++i) {
+        const query_statistics& shape = statistics[i];
+
+        file << std::format("  {{ \"shape\": \"{}\", \"calls\": {}, \"total_us\": {}, \"mean_us\": {}, \"p50_us\": {}, \"p95_us\": {}, \"p99_us\": {}, \"rows\": {}, \"sql_bytes\": {}, \"fullscan_steps\": {}, \"sorts\": {}, \"autoindexes\": {}, \"vm_steps\": {}, \"reprepares\": {}, \"memused\": {} }}",
+            json_escape(shape.shape), shape.calls, to_us(shape.total), to_us(shape.mean()), to_us(shape.percentile(50)), to_us(shape.percentile(95)), to_us(shape.percentile(99)), shape.rows, shape.sql_bytes,
+            shape.status.fullscan_steps, shape.status.sorts, shape.status.autoindexes, shape.status.vm_steps, shape.status.reprepares, shape.status.memused);
+
+        file << (i + 1 < statistics.size() ? ",\n" : "\n");
+    }
+
+    file << "]\n";
+}
+
+//END QUERY STATISTICS
+
+//PROFILER
+
+bool uva::database::enable_profiler = uva::database::enable_profiler_default;
+
+#ifdef UVA_DATABASE_COUNT_ALLOCATIONS
+
+static thread_local size_t s_thread_allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++s_thread_allocations;
+
+    if(void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+size_t uva::database::thread_allocations()
+{
+    return s_thread_allocations;
+}
+
+#else
+
+size_t uva::database::thread_allocations()
+{
+    return 0;
+}
+
+#endif
+
+std::string_view uva::database::profiler_stage_name(profiler_stage stage)
+{
+    static constexpr std::array<std::string_view, profiler_stages> names = {
+        "build", "prepare", "step", "decode", "row_map", "record"
+    };
+
+    return names[(size_t)stage];
+}
+
+// Each thread aggregates into its own map, so timers only take an uncontended lock.
+struct thread_profiles
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, uva::database::call_site_profile> call_sites;
+};
+
+static std::mutex s_profiles_mutex;
+
+static std::vector<std::shared_ptr<thread_profiles>>& profiles_storage()
+{
+    static std::vector<std::shared_ptr<thread_profiles>> storage;
+    return storage;
+}
+
+static thread_profiles& local_profiles()
+{
+    thread_local std::shared_ptr<thread_profiles> profiles = [] {
+        auto profiles = std::make_shared<thread_profiles>();
+
+        std::lock_guard lock(s_profiles_mutex);
+        profiles_storage().push_back(profiles);
+
+        return profiles;
+    }();
+
+    return *profiles;
+}
+
+static const std::string s_unscoped_call_site = "(unscoped)";
+static thread_local const std::string* s_current_call_site = &s_unscoped_call_site;
+
+uva::database::profiler_scope::profiler_scope(std::source_location location)
+    : profiler_scope(std::format("{}:{}", location.file_name(), location.line()))
+{
+
+}
+
+uva::database::profiler_scope::profiler_scope(std::string call_site)
+    : m_call_site(std::move(call_site)), m_previous(s_current_call_site)
+{
+    s_current_call_site = &m_call_site;
+}
+
+uva::database::profiler_scope::~profiler_scope()
+{
+    s_current_call_site = m_previous;
+}
+
+void uva::database::stage_timer::record()
+{
+    thread_profiles& profiles = local_profiles();
+
+    std::lock_guard lock(profiles.mutex);
+
+    call_site_profile& call_site = profiles.call_sites[*s_current_call_site];
+
+    if(call_site.call_site.empty()) {
+        call_site.call_site = *s_current_call_site;
+    }
+
+    stage_profile& stage = call_site.stages[(size_t)m_stage];
+
+    stage.calls       += 1;
+    stage.total       += m_elapsed;
+    stage.allocations += m_allocations;
+}
+
+std::vector<uva::database::call_site_profile> uva::database::get_profiles()
+{
+    std::map<std::string, call_site_profile> merged;
+
+    std::lock_guard lock(s_profiles_mutex);
+
+    for(const auto& profiles : profiles_storage()) {
+        std::lock_guard profiles_lock(profiles->mutex);
+
+        for(const auto& [name, profile] : profiles->call_sites) {
+            call_site_profile& call_site = merged[name];
+            call_site.call_site = name;
+
+            for(size_t stage = 0; stage < profiler_stages; ++stage) {
+                call_site.stages[stage].calls       += profile.stages[stage].calls;
+                call_site.stages[stage].total       += profile.stages[stage].total;
+                call_site.stages[stage].allocations += profile.stages[stage].allocations;
+            }
+        }
+    }
+
+    std::vector<call_site_profile> call_sites;
+    call_sites.reserve(merged.size());
+
+    for(auto& call_site : merged) {
+        call_sites.push_back(std::move(call_site.second));
+    }
+
+    return call_sites;
+}
+
+void uva::database::reset_profiles()
+{
+    std::lock_guard lock(s_profiles_mutex);
+
+    for(const auto& profiles : profiles_storage()) {
+        std::lock_guard profiles_lock(profiles->mutex);
+        profiles->call_sites.clear();
+    }
+}
+
+//END PROFILER
+
+using basic_migration = uva::database::basic_migration;
+uva_database_define_full(basic_migration, "database_migrations");
+
+//BASIC CONNECTION
+
+std::atomic<uva::database::basic_connection*> uva::database::basic_connection::s_connection = nullptr;
+thread_local uva::database::basic_connection* uva::database::basic_connection::s_thread_connection = nullptr;
+
+uva::database::basic_connection::basic_connection()
+{
+    s_connection = this;
+}
+
+uva::database::basic_connection::basic_connection(detached_t)
+{
+
+}
+
+uva::database::basic_connection* uva::database::basic_connection::get_connection()
+{
+    return s_thread_connection ? s_thread_connection : s_connection.load();
+}
+
+uva::database::basic_connection* uva::database::basic_connection::get_default_connection()
+{
+    return s_connection;
+}
+
+void uva::database::basic_connection::set_default_connection(basic_connection* connection)
+{
+    s_connection = connection;
+}
+
+void uva::database::basic_connection::set_thread_connection(basic_connection* connection)
+{
+    s_thread_connection = connection;
+}
+
+uva::database::basic_connection* uva::database::basic_connection::get_thread_connection()
+{
+    return s_thread_connection;
+}
+
+std::atomic<size_t> uva::database::connection_scope::s_active = 0;
+thread_local size_t uva::database::connection_scope::s_thread_active = 0;
+
+uva::database::connection_scope::connection_scope(basic_connection* connection)
+    : m_previous(basic_connection::get_thread_connection())
+{
+    basic_connection::set_thread_connection(connection);
+
+    ++s_active;
+    ++s_thread_active;
+}
+
+uva::database::connection_scope::~connection_scope()
+{
+    basic_connection::set_thread_connection(m_previous);
+
+    --s_thread_active;
+    --s_active;
+}
+
+size_t uva::database::connection_scope::active_in_other_threads()
+{
+    return s_active - s_thread_active;
+}
+
+//SQLITE3 CONNECTION
+
+uva::database::sqlite3_connection::sqlite3_connection()
+{
+
+}
+
+uva::database::sqlite3_connection::sqlite3_connection(detached_t)
+    : basic_connection(detached)
+{
+
+}
+
+uva::database::sqlite3_connection::sqlite3_connection(const std::filesystem::path& database_path)
+    : m_database_path(database_path)
+{
+    open();
+}
+
+uva::database::sqlite3_connection::~sqlite3_connection()
+{
+    basic_connection* self = this;
+    s_connection.compare_exchange_strong(self, nullptr);
+
+    if(get_thread_connection() == this) {
+        set_thread_connection(nullptr);
+    }
+
+    clear_statements();
+    sqlite3_close(m_database);
+}
+
+uva::database::sqlite3_connection::prepared_statement::~prepared_statement()
+{
+    sqlite3_finalize(stmt);
+}
+
+std::unique_ptr<uva::database::sqlite3_connection::prepared_statement> uva::database::sqlite3_connection::acquire_statement(const std::string& sql)
+{
+    size_t generation = 0;
+
+    {
+        std::lock_guard lock(m_statements_mutex);
+
+        auto it = m_statements.find(sql);
+
+        if(it != m_statements.end()) {
+            std::unique_ptr<prepared_statement> statement = std::move(it->second);
+            m_statements.erase(it);
+            return statement;
+        }
+
+        generation = m_statements_generation;
+    }
+
+    std::unique_ptr<prepared_statement> statement = std::make_unique<prepared_statement>();
+    statement->generation = generation;
+
+    if(sqlite3_prepare_v2(m_database, sql.c_str(), (int)sql.size(), &statement->stmt, nullptr)) {
+        return nullptr;
+    }
+
+    int columns_count = sqlite3_column_count(statement->stmt);
+
+    statement->columns_names.reserve(columns_count);
+    statement->columns_types.reserve(columns_count);
+    statement->decoders.reserve(columns_count);
+
+    for(int column = 0; column < columns_count; ++column) {
+        const char* declared_type = sqlite3_column_decltype(statement->stmt, column);
+
+        statement->columns_names.push_back(sqlite3_column_name(statement->stmt, column));
+        statement->columns_types.push_back(sql_delctype_to_value_type(declared_type ? declared_type : "TEXT"));
+        statement->decoders.push_back(sql_column_decoder(sql_type_affinity(declared_type)));
+    }
+
+    return statement;
+}
+
+void uva::database::sqlite3_connection::release_statement(const std::string& sql, std::unique_ptr<prepared_statement> statement)
+{
+    if(!statement) {
+        return;
+    }
+
+    sqlite3_reset(statement->stmt);
+    sqlite3_clear_bindings(statement->stmt);
+
+    std::lock_guard lock(m_statements_mutex);
+
+    // Statements prepared before a schema change may decode columns with the wrong types.
+    if(statement->generation != m_statements_generation || !statement_cache_capacity) {
+        return;
+    }
+
+    if(m_statements.size() >= statement_cache_capacity) {
+        m_statements.erase(m_statements.begin());
+    }
+
+    m_statements.insert({ sql, std::move(statement) });
+}
+
+void uva::database::sqlite3_connection::clear_statements()
+{
+    std::lock_guard lock(m_statements_mutex);
+
+    m_statements.clear();
+    ++m_statements_generation;
+}
+
+void uva::database::sqlite3_connection::write_blob(uva::database::table* table, const std::string& column, size_t id, const void* data, size_t size)
+{
+    std::string sql = "UPDATE " + table->m_name + " SET " + column + " = ? WHERE id = ?;";
+
+    std::unique_ptr<prepared_statement> statement = acquire_statement(sql);
+
+    if(!statement) {
+        throw std::runtime_error(sqlite3_errmsg(m_database));
+    }
+
+    sqlite3_bind_blob64(statement->stmt, 1, data, size, SQLITE_STATIC);
+    sqlite3_bind_int64(statement->stmt, 2, id);
+
+    int error = sqlite3_step(statement->stmt);
+
+    release_statement(sql, std::move(statement));
+
+    if(error != SQLITE_DONE) {
+        throw std::runtime_error(sqlite3_errmsg(m_database));
+    }
+}
+
+void uva::database::sqlite3_connection::allocate_blob(uva::database::table* table, const std::string& column, size_t id, size_t size)
+{
+    std::string sql = "UPDATE " + table->m_name + " SET " + column + " = zeroblob(?) WHERE id = ?;";
+
+    std::unique_ptr<prepared_statement> statement = acquire_statement(sql);
+
+    if(!statement) {
+        throw std::runtime_error(sqlite3_errmsg(m_database));
+    }
+
+    sqlite3_bind_int64(statement->stmt, 1, size);
+    sqlite3_bind_int64(statement->stmt, 2, id);
+
+    int error = sqlite3_step(statement->stmt);
+
+    release_statement(sql, std::move(statement));
+
+    if(error != SQLITE_DONE) {
+        throw std::runtime_error(sqlite3_errmsg(m_database));
+    }
+}
+
+size_t uva::database::sqlite3_connection::read_blob(uva::database::table* table, const std::string& column, size_t id, void* buffer, size_t size, size_t offset)
+{
+    uva::database::blob_stream stream(table, column, id);
+    stream.seek(offset);
+
+    return stream.read(buffer, size);
+}
+
+bool uva::database::sqlite3_connection::open()
+{
+    std::filesystem::path folder = m_database_path.parent_path();
+    if (!std::filesystem::exists(folder)) {
+        if (!std::filesystem::create_directories(folder)) {
+            throw std::runtime_error("unknow error while creating databse directories.");
+        }
+    }
+    int error = sqlite3_open(m_database_path.string().c_str(), &m_database);    
+    if (error) {        
+        throw std::runtime_error("unknow error while opening database.");
+    }
+    sqlite3_update_hook(m_database, &sqlite3_connection::update_hook, this);
+    sqlite3_set_authorizer(m_database, &sqlite3_connection::authorizer, this);
+    load_schema();
+    return m_database;
+}
+
+bool uva::database::sqlite3_connection::open(const std::filesystem::path& path, bool load_schema)
+{
+    m_database_path = path;
+    int error = sqlite3_open(m_database_path.string().c_str(), &m_database);
+    if (error) {
+        throw std::runtime_error("unknow error while opening databse.");
+    }
+    sqlite3_update_hook(m_database, &sqlite3_connection::update_hook, this);
+    sqlite3_set_authorizer(m_database, &sqlite3_connection::authorizer, this);
+    if(load_schema) {
+        this->load_schema();
+    }
+    return m_database;
+}
+
+void uva::database::sqlite3_connection::update_hook(void* data, int operation, const char* database, const char* table_name, sqlite3_int64 rowid)
+{
+    // The hook must not touch the connection, so rows are only marked here and reloaded by table::sync_relations.
+    // Writes to other databases (e.g. template clones) don't change the cached rows.
+    uva::database::basic_connection* connection = (uva::database::sqlite3_connection*)data;
+
+    std::lock_guard lock(uva::database::table::get_cached_tables_mutex());
+
+    for(uva::database::table* table : uva::database::table::get_cached_tables()) {
+        if(table->m_name == table_name && table->m_cache_connection == connection) {
+            table->invalidate_relation(rowid);
+        }
+    }
+}
+
+int uva::database::sqlite3_connection::authorizer(void* data, int action, const char* table_name, const char* column, const char* database, const char* trigger)
+{
+    // DELETE without WHERE (the truncate optimization) doesn't call the update hook. SQLITE_IGNORE still runs
+    // the delete, but row by row, so every deleted row of a cached table goes through the hook.
+    if(action != SQLITE_DELETE || !table_name) {
+        return SQLITE_OK;
+    }
+
+    uva::database::basic_connection* connection = (uva::database::sqlite3_connection*)data;
+
+    std::lock_guard lock(uva::database::table::get_cached_tables_mutex());
+
+    for(uva::database::table* table : uva::database::table::get_cached_tables()) {
+        if(table->m_name == table_name && table->m_cache_connection == connection) {
+            return SQLITE_IGNORE;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+bool uva::database::sqlite3_connection::create_table(const uva::database::table* table) const
+{
+    std::string error_report;
+    std::string sql;
+
+    auto elapsed = uva::diagnostics::measure_function([&]{
+        /* Create SQL statement */
+
+        sql = "CREATE TABLE IF NOT EXISTS " + table->definition() + ";";
+
+        /* Execute SQL statement */
+
+        char* error_msg = nullptr;
+        int error = sqlite3_exec(m_database, sql.c_str(),
+            [](void *NotUsed, int columnCount, char **columnValue, char **value) {
+            return 0;
+        }, 0, &error_msg);
+
+        if (error) {
+            error_report = error_msg;
+            sqlite3_free(error_msg);
+        }
+    });
+
+    report_query(sql, elapsed, error_report);
+
+    return true;
+}
+
+static void for_each_schema_row(sqlite3* database, const std::string& sql, const std::string& parameter, std::function<void(sqlite3_stmt*)> func);
+
+// Runs internal statements of a rebuild, which are not logged.
+static void execute_schema_sql(sqlite3* database, const std::string& sql)
+{
+    char* error_msg = nullptr;
+
+    if(sqlite3_exec(database, sql.c_str(), nullptr, nullptr, &error_msg)) {
+        std::string error_report = error_msg;
+        sqlite3_free(error_msg);
+        throw std::runtime_error(error_report);
+    }
+}
+
+static std::shared_mutex s_rebuild_progress_hook_mutex;
+static uva::database::rebuild_progress_hook s_rebuild_progress_hook;
+
+uva::database::rebuild_progress_hook uva::database::get_rebuild_progress_hook()
+{
+    std::shared_lock lock(s_rebuild_progress_hook_mutex);
+    return s_rebuild_progress_hook;
+}
+
+void uva::database::set_rebuild_progress_hook(rebuild_progress_hook hook)
+{
+    std::unique_lock lock(s_rebuild_progress_hook_mutex);
+    s_rebuild_progress_hook = std::move(hook);
+}
+
+// Columns copied by a rebuild. Generated columns are computed again by the new table.
+static std::vector<std::string> stored_columns(const uva::database::table* table)
+{
+    std::vector<std::string> columns;
+
+    for(const auto& column : table->m_columns) {
+        if(!table->m_generated_columns.contains(column.first)) {
+            columns.push_back(column.first);
+        }
+    }
+
+    return columns;
+}
+
+void uva::database::sqlite3_connection::alter_table(uva::database::table* table, const std::string& new_signature)
+{
+    std::string cols = uva::string::join(stored_columns(table), ", ");
+
+    // Indexes are dropped with the old table, the ones created by CREATE INDEX (with sql) are created again.
+    std::vector<table::index_definition> indexes = table->m_indexes;
+
+    // The chunks commit on their own, they can't be part of an outer transaction (e.g. a migration).
+    if(enable_online_rebuild && !sqlite3_get_autocommit(m_database)) {
+        throw std::runtime_error(std::format("cannot rebuild {} online inside a transaction or a migration, disable enable_online_rebuild to rebuild it in the transaction", table->m_name));
+    }
+
+    // Without a rowid, rows have no integer key to be copied in chunks by.
+    if(enable_online_rebuild && table->m_without_rowid) {
+        throw std::runtime_error(std::format("cannot rebuild {} online, it is a WITHOUT ROWID table. Disable enable_online_rebuild to rebuild it in a single transaction", table->m_name));
+    }
+
+    bool online = enable_online_rebuild;
+
+    if(online) {
+        online_rebuild(table, new_signature, cols);
+    } else {
+        std::string oldTableName = table->m_name + "_old";
+
+        // Inside a transaction (e.g. a migration), the rebuild is a savepoint of it. PRAGMA foreign_keys
+        // has no effect there, so foreign keys are only checked when the outer transaction commits.
+        bool nested = !sqlite3_get_autocommit(m_database);
+
+        std::string sql = nested ?
+            "PRAGMA defer_foreign_keys = on;"
+            "SAVEPOINT rebuild;"
+            :
+            "PRAGMA foreign_keys = off;"
+            "BEGIN TRANSACTION;";
+
+        sql +=
+            "ALTER TABLE " + table->m_name + " RENAME TO " + oldTableName + ";"
+            "CREATE TABLE " + new_signature + ";"
+            "INSERT INTO " + table->m_name + " (" + cols + ") SELECT " + cols + " FROM " + oldTableName + ";"
+            "DROP TABLE " + oldTableName + ";";
+
+        for(const auto& index : indexes) {
+            if(index.sql.size()) {
+                sql += index.sql + ";";
+            }
+        }
+
+        sql += nested ?
+            "RELEASE rebuild;"
+            :
+            "COMMIT; "
+            "PRAGMA foreign_keys = on;";
+
+        try {
+            execute_schema_sql(m_database, sql);
+        } catch(...) {
+            if(nested) {
+                execute_schema_sql(m_database, "ROLLBACK TO rebuild; RELEASE rebuild;");
+            } else if(!sqlite3_get_autocommit(m_database)) {
+                execute_schema_sql(m_database, "ROLLBACK; PRAGMA foreign_keys = on;");
+            }
+            throw;
+        }
+    }
+
+    read_schema(table);
+
+    if(table->m_cached) {
+        table->load_relations();
+    }
+}
+
+void uva::database::sqlite3_connection::online_rebuild(uva::database::table* table, const std::string& new_signature, const std::string& cols)
+{
+    const std::string& name = table->m_name;
+    const std::string new_name = name + "_new";
+
+    // new_signature is "name(columns...)".
+    execute_schema_sql(m_database,
+        "DROP TABLE IF EXISTS " + new_name + ";"
+        "CREATE TABLE " + new_name + new_signature.substr(name.size()) + ";"
+    );
+
+    // On failure drop the triggers and the copy, otherwise every later write to the old table
+    // would still be forwarded to the abandoned copy.
+    auto abandon = [&]() {
+        if(!sqlite3_get_autocommit(m_database)) {
+            sqlite3_exec(m_database, "ROLLBACK;", nullptr, nullptr, nullptr);
+        }
+
+        sqlite3_exec(m_database, std::format(
+            "DROP TRIGGER IF EXISTS {0}_rebuild_insert;"
+            "DROP TRIGGER IF EXISTS {0}_rebuild_update;"
+            "DROP TRIGGER IF EXISTS {0}_rebuild_delete;"
+            "DROP TABLE IF EXISTS {1};"
+            "PRAGMA foreign_keys = on;", name, new_name).c_str(), nullptr, nullptr, nullptr);
+    };
+
+    try {
+        copy_online(table, new_signature, cols);
+    } catch(...) {
+        abandon();
+        throw;
+    }
+}
+
+void uva::database::sqlite3_connection::copy_online(uva::database::table* table, const std::string& new_signature, const std::string& stored_cols)
+{
+    const std::string& name = table->m_name;
+    const std::string new_name = name + "_new";
+
+    std::vector<table::index_definition> indexes = table->m_indexes;
+
+    // Rows are chunked by rowid. Unless the key is an alias of it, the rowid is copied too, so the triggers
+    // find the copy of a row by the rowid of the original.
+    std::string key = "rowid";
+    std::vector<std::string> key_columns = table->primary_key_columns();
+
+    if(key_columns.size() == 1) {
+        std::string type = table->find_column(key_columns.front())->second;
+        std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+
+        if(type.starts_with("INTEGER")) {
+            key = key_columns.front();
+        }
+    }
+
+    std::string cols = key == "rowid" ? "rowid, " + stored_cols : stored_cols;
+
+    std::string new_values = uva::string::join(uva::string::join(stored_columns(table), [](const std::string& column) {
+        return "NEW." + column;
+    }), ", ");
+
+    if(key == "rowid") {
+        new_values = "NEW.rowid, " + new_values;
+    }
+
+    // From now on, every write to the old table is replayed on the new one. Rows written
+    // here are newer than the ones being copied, so the copy never overwrites them.
+    execute_schema_sql(m_database, std::format(
+        "CREATE TRIGGER {0}_rebuild_insert AFTER INSERT ON {0} BEGIN INSERT OR REPLACE INTO {1} ({2}) VALUES ({3}); END;"
+        "CREATE TRIGGER {0}_rebuild_update AFTER UPDATE ON {0} BEGIN DELETE FROM {1} WHERE {4} = OLD.{4}; INSERT OR REPLACE INTO {1} ({2}) VALUES ({3}); END;"
+        "CREATE TRIGGER {0}_rebuild_delete AFTER DELETE ON {0} BEGIN DELETE FROM {1} WHERE {4} = OLD.{4}; END;",
+        name, new_name, cols, new_values, key));
+
+    size_t total = 0;
+    for_each_schema_row(m_database, "SELECT COUNT(*) FROM " + name + ";", "", [&](sqlite3_stmt* stmt) {
+        total = (size_t)sqlite3_column_int64(stmt, 0);
+    });
+
+    const size_t chunk_size = std::max<size_t>(1, online_rebuild_chunk_size);
+    const rebuild_progress_hook progress = get_rebuild_progress_hook();
+
+    int64_t last_id = std::numeric_limits<int64_t>::min();
+    size_t copied = 0;
+
+    while(true) {
+        int64_t chunk_end = 0;
+        size_t rows = 0;
+
+        execute_schema_sql(m_database, "BEGIN IMMEDIATE;");
+
+        try {
+            for_each_schema_row(m_database, std::format("SELECT COUNT(*), MAX(chunk_key) FROM (SELECT {0} AS chunk_key FROM {1} WHERE {0} > {2} ORDER BY {0} LIMIT {3});", key, name, last_id, chunk_size), "", [&](sqlite3_stmt* stmt) {
+                rows      = (size_t)sqlite3_column_int64(stmt, 0);
+                chunk_end = sqlite3_column_int64(stmt, 1);
+            });
+
+            if(rows) {
+                execute_schema_sql(m_database, std::format("INSERT OR IGNORE INTO {0} ({1}) SELECT {1} FROM {2} WHERE {5} > {3} AND {5} <= {4};", new_name, cols, name, last_id, chunk_end, key));
+            }
+
+            execute_schema_sql(m_database, "COMMIT;");
+        } catch(...) {
+            sqlite3_exec(m_database, "ROLLBACK;", nullptr, nullptr, nullptr);
+            throw;
+        }
+
+        if(!rows) {
+            break;
+        }
+
+        last_id = chunk_end;
+        copied += rows;
+
+        if(progress) {
+            progress(name, copied, total);
+        }
+    }
+
+    std::string upper_signature = new_signature;
+    std::transform(upper_signature.begin(), upper_signature.end(), upper_signature.begin(), ::toupper);
+
+    std::string swap =
+        "PRAGMA foreign_keys = off;"
+        "BEGIN IMMEDIATE;";
+
+    // Keeps AUTOINCREMENT from reusing ids of rows deleted from the end of the old table.
+    if(upper_signature.find("AUTOINCREMENT") != std::string::npos) {
+        swap += std::format("UPDATE sqlite_sequence SET seq = MAX(seq, IFNULL((SELECT seq FROM sqlite_sequence WHERE name = '{0}'), 0)) WHERE name = '{1}';", name, new_name);
+    }
+
+    swap += std::format(
+        "DROP TABLE {0};"
+        "ALTER TABLE {1} RENAME TO {0};", name, new_name);
+
+    for(const auto& index : indexes) {
+        if(index.sql.size()) {
+            swap += index.sql + ";";
+        }
+    }
+
+    swap +=
+        "COMMIT;"
+        "PRAGMA foreign_keys = on;";
+
+    execute_schema_sql(m_database, swap);
+}
+
+bool uva::database::sqlite3_connection::insert(table* table, size_t id, const std::map<std::string, std::string>& relations) {
+    char* error_msg = nullptr;
+    std::string sql = "INSERT INTO " + table->m_name + " VALUES(" + std::to_string(id);
+    
+    for(const auto& col : table->m_columns) {
+        sql += ", \"";
+        auto it = relations.find(col.first);
+        if(it != relations.end()) {
+            if (col.second == "TEXT") {
+                sql.reserve(sql.size() + it->second.size());
+                for (const char& c : it->second) {
+                    if (c == '\"') {
+                        sql.push_back('\"');
+                    }
+                    sql.push_back(c);
+                }                
+            }
+            else {
+                sql += it->second;
+            }
+        }
+        sql += "\"";
+    }
+    
+    sql += ");";
+    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);
+            
+    if (error) {
+        std::string error_report = error_msg;
+        sqlite3_free(error_msg);
+        throw std::runtime_error(error_report);
+    }
+    return true;
+}
+
+bool uva::database::sqlite3_connection::insert(table* table, size_t id, const std::vector<std::map<std::string, std::string>>& relations)
+{
+    //todo: merge those functions
+    char* error_msg = nullptr;
+    std::string sql = "INSERT INTO " + table->m_name + " VALUES\n";
+        
+    for (const auto& relation : relations) {
+        sql += "(" + std::to_string(id++);
+        for (const auto& col : table->m_columns) {
+            sql += ", \"";
+            auto it = relation.find(col.first);
+            if (it != relation.end()) {
+                if (col.second == "TEXT") {
+                    sql.reserve(sql.size() + it->second.size());
+                    for (const char& c : it->second) {
+                        if (c == '\"') {
+                            sql.push_back('\"');
+                        }
+                        sql.push_back(c);
+                    }
+                }
+                else {
+                    sql += it->second;
+                }
+            }
+            sql += "\"";
+        }
+        sql += "),\n";
+    }
+
+    sql[sql.size() - 2] = ';';
+    
+    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);
+
+    if (error) {
+        std::string error_report = error_msg;
+        sqlite3_free(error_msg);
+        throw std::runtime_error(error_report);
+    }
+    return true;
+}
+
+bool uva::database::sqlite3_connection::is_open() const
+{
+    return m_database;
+}
+
+void uva::database::sqlite3_connection::update(size_t id, const std::string& key, const std::string& value, uva::database::table* table) {
+    char* error_msg = nullptr;
+    std::string sql = "UPDATE " + table->m_name + " SET " + key + " = '" + value + "' where id = " + std::to_string(id);    
+    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);    
+    if (error) {
+        std::string error_report = error_msg;
+        sqlite3_free(error_msg);
+        throw std::runtime_error(error_report);
+    }
+}
+
+void uva::database::sqlite3_connection::destroy(size_t id, uva::database::table* table)
+{
+    char* error_msg = nullptr;
+    std::string sql = "DELETE FROM " + table->m_name + " where id = " + std::to_string(id);    
+    int error = sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg);    
+    if (error) {
+        std::string error_report = error_msg;
+        sqlite3_free(error_msg);
+        throw std::runtime_error(error_report);
+    }
+}
+
+// ALTER TABLE ADD COLUMN only updates the schema, but SQLite refuses columns that would need
+// existing rows to be rewritten or checked. See https://www.sqlite.org/lang_altertable.html#altertabaddcol
+static bool can_add_column_natively(const std::string& type)
+{
+    std::string upper = type;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+    // A type with its own DEFAULT or GENERATED clause conflicts with the DEFAULT added for default_value.
+    static const char* rebuild_markers[] = {
+        "PRIMARY KEY",
+        "UNIQUE",
+        "GENERATED",
+        "STORED",
+        "DEFAULT",
+        "CURRENT_TIME",
+        "CURRENT_DATE",
+        "REFERENCES",
+    };
+
+    for(const char* marker : rebuild_markers) {
+        if(upper.find(marker) != std::string::npos) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// " DEFAULT 'value'" for default_value, nothing when the type declares its own default or a generated value.
+static std::string column_default_clause(const std::string& type, const std::string& default_value)
+{
+    std::string upper = type;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+    if(upper.find("DEFAULT") != std::string::npos || upper.find("GENERATED") != std::string::npos) {
+        return "";
+    }
+
+    std::string clause = " DEFAULT '";
+
+    for(const char& c : default_value) {
+        if(c == '\'') {
+            clause.push_back('\'');
+        }
+        clause.push_back(c);
+    }
+
+    clause.push_back('\'');
+
+    return clause;
+}
+
+void uva::database::sqlite3_connection::add_column(uva::database::table* table, const std::string& name, const std::string& type, const std::string& default_value)
+{
+    if(can_add_column_natively(type)) {
+        std::string error_report;
+        std::string sql = "ALTER TABLE " + table->m_name + " ADD COLUMN " + name + " " + type + column_default_clause(type, default_value) + ";";
+
+        auto elapsed = uva::diagnostics::measure_function([&]{
+            char* error_msg = nullptr;
+
+            if(sqlite3_exec(m_database, sql.c_str(), nullptr, nullptr, &error_msg)) {
+                error_report = error_msg;
+                sqlite3_free(error_msg);
+            }
+        });
+
+        report_query(sql, elapsed, error_report);
+
+        read_schema(table);
+
+        // Reloaded like after a rebuild, so cache indexes on the new column are filled too.
+        if(table->m_cached) {
+            table->load_relations();
+        }
+
+        return;
+    }
+
+    std::string new_definition = table->definition({ { name, type + column_default_clause(type, default_value) } });
+
+    // Reads the schema and reloads cached rows.
+    alter_table(table, new_definition);
+}
+
+void uva::database::sqlite3_connection::change_column(uva::database::table* table, const std::string& name, const std::string& type)
+{
+    auto it = table->find_column(name);
+
+    std::string previous_type = it->second;
+    it->second = type;
+
+    std::string new_definition = table->definition();
+
+    // alter_table reads the new type back from the schema. If it throws, the column keeps the old one.
+    it->second = previous_type;
+
+    alter_table(table, new_definition);
+}
+
+// Runs an internal query (schema reads) without going through active_record_relation and its logging.
+static void for_each_schema_row(sqlite3* database, const std::string& sql, const std::string& parameter, std::function<void(sqlite3_stmt*)> func)
+{
+    sqlite3_stmt* stmt = nullptr;
+
+    if(sqlite3_prepare_v2(database, sql.c_str(), (int)sql.size(), &stmt, nullptr)) {
+        throw std::runtime_error(sqlite3_errmsg(database));
+    }
+
+    if(parameter.size()) {
+        sqlite3_bind_text(stmt, 1, parameter.c_str(), (int)parameter.size(), SQLITE_TRANSIENT);
+    }
+
+    while(sqlite3_step(stmt) == SQLITE_ROW) {
+        func(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+static std::string column_text(sqlite3_stmt* stmt, int index)
+{
+    const unsigned char* text = sqlite3_column_text(stmt, index);
+    return text ? (const char*)text : "";
+}
+
+// Splits the body of a CREATE TABLE statement into (name, definition) pairs, in order. Table constraints
+// come out split on their first word, e.g. ("UNIQUE", "(a, b)") or ("FOREIGN", "KEY(a) REFERENCES t(id)").
+static std::vector<std::pair<std::string, std::string>> column_definitions(const std::string& create_sql)
+{
+    std::vector<std::pair<std::string, std::string>> definitions;
+
+    size_t begin = create_sql.find('(');
+    size_t end   = create_sql.rfind(')');
+
+    if(begin == std::string::npos || end == std::string::npos || end < begin) {
+        return definitions;
+    }
+
+    std::vector<std::string> parts(1);
+    int depth = 0;
+    char quote = 0;
+
+    for(size_t i = begin + 1; i < end; ++i) {
+        char c = create_sql[i];
+
+        if(quote) {
+            quote = c == quote ? 0 : quote;
+        } else if(c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if(c == '(') {
+            ++depth;
+        } else if(c == ')') {
+            --depth;
+        } else if(c == ',' && !depth) {
+            parts.emplace_back();
+            continue;
+        }
+
+        parts.back().push_back(c);
+    }
+
+    for(std::string& part : parts) {
+        size_t name_begin = part.find_first_not_of(" \t\r\n");
+
+        if(name_begin == std::string::npos) {
+            continue;
+        }
+
+        size_t name_end = part.find_first_of(" \t\r\n(", name_begin);
+        std::string name = part.substr(name_begin, name_end - name_begin);
+
+        if(name.size() > 1 && (name.front() == '"' || name.front() == '`' || name.front() == '[')) {
+            name = name.substr(1, name.size() - 2);
+        }
+
+        size_t definition_begin = name_end == std::string::npos ? std::string::npos : part.find_first_not_of(" \t\r\n", name_end);
+        definitions.push_back({ std::move(name), definition_begin == std::string::npos ? "" : part.substr(definition_begin) });
+    }
+
+    return definitions;
+}
+
+void uva::database::sqlite3_connection::read_schema(uva::database::table* table)
+{
+    clear_statements();
+
+    table->m_columns.clear();
+    table->m_columns_types.clear();
+    table->m_indexes.clear();
+    table->m_generated_columns.clear();
+    table->m_constraints.clear();
+    table->primary_key.clear();
+    table->m_without_rowid = false;
+    table->m_strict = false;
+
+    bool exists = false;
+    bool autoincrement = false;
+    std::string create_sql;
+
+    for_each_schema_row(m_database, "SELECT sql FROM sqlite_schema WHERE type = 'table' AND name = ?;", table->m_name, [&](sqlite3_stmt* stmt) {
+        exists = true;
+        create_sql = column_text(stmt, 0);
+    });
+
+    if(!exists) {
+        table->update_default_scope();
+        return;
+    }
+
+    std::string upper_sql = create_sql;
+    std::transform(upper_sql.begin(), upper_sql.end(), upper_sql.begin(), ::toupper);
+    autoincrement = upper_sql.find("AUTOINCREMENT") != std::string::npos;
+
+    // Table options follow the column list.
+    std::string options = upper_sql.substr(upper_sql.rfind(')') + 1);
+    table->m_without_rowid = options.find("WITHOUT ROWID") != std::string::npos;
+    table->m_strict        = options.find("STRICT") != std::string::npos;
+
+    // Definitions are taken as written, so column constraints (UNIQUE, CHECK, REFERENCES, COLLATE...)
+    // survive rebuilds. The pragma is only a fallback for columns the parser could not name.
+    std::vector<std::pair<std::string, std::string>> definitions = column_definitions(create_sql);
+    std::vector<std::pair<size_t, std::string>> primary_keys;
+
+    auto written_definition = [&](const std::string& name) -> const std::string* {
+        auto it = std::find_if(definitions.begin(), definitions.end(), [&](const std::pair<std::string, std::string>& definition) {
+            return definition.first == name;
+        });
+
+        return it != definitions.end() ? &it->second : nullptr;
+    };
+
+    // cid, name, type, notnull, dflt_value, pk, hidden. Generated columns are hidden 2 (virtual) or 3 (stored).
+    for_each_schema_row(m_database, "PRAGMA table_xinfo(" + table->m_name + ");", "", [&](sqlite3_stmt* stmt) {
+        std::string name = column_text(stmt, 1);
+        std::string type = column_text(stmt, 2);
+        std::string definition = type;
+        int hidden = sqlite3_column_int(stmt, 6);
+
+        if(hidden == 2 || hidden == 3) {
+            table->m_generated_columns.insert(name);
+        }
+
+        if(int pk = sqlite3_column_int(stmt, 5)) {
+            primary_keys.push_back({ (size_t)pk, name });
+        }
+
+        if(const std::string* written = written_definition(name)) {
+            definition = *written;
+        } else {
+            if(sqlite3_column_int(stmt, 3)) {
+                definition += " NOT NULL";
+            }
+
+            if(sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+                definition += " DEFAULT ";
+                definition += column_text(stmt, 4);
+            }
+        }
+
+        table->m_columns.push_back({ std::move(name), std::move(definition) });
+        table->m_columns_types.push_back(sql_delctype_to_value_type(type));
+    });
+
+    // Everything which is not a column is a table constraint. The primary key is written again from primary_key.
+    for(const auto& definition : definitions) {
+        if(table->m_columns.end() != std::find_if(table->m_columns.begin(), table->m_columns.end(), [&](const std::pair<std::string, std::string>& column) {
+            return column.first == definition.first;
+        })) {
+            continue;
+        }
+
+        std::string constraint = definition.second.empty() ? definition.first : definition.first + " " + definition.second;
+        std::string upper = constraint;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+        if(upper.find("PRIMARY KEY") == std::string::npos) {
+            table->m_constraints.push_back(std::move(constraint));
+        }
+    }
+
+    // pk is the position of the column in the key, which is not the column order for composite keys.
+    std::sort(primary_keys.begin(), primary_keys.end());
+
+    // A composite primary key is a table constraint and cannot be expressed per column, see table::definition.
+    if(primary_keys.size() == 1) {
+        std::string& definition = table->find_column(primary_keys.front().second)->second;
+        std::string upper = definition;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+        if(upper.find("PRIMARY KEY") == std::string::npos) {
+            size_t type_end = definition.find(' ');
+
+            definition.insert(type_end == std::string::npos ? definition.size() : type_end, autoincrement ? " PRIMARY KEY AUTOINCREMENT" : " PRIMARY KEY");
+        }
+    }
+
+    table->primary_key = uva::string::join(uva::string::join(primary_keys, [](const std::pair<size_t, std::string>& key) {
+        return key.second;
+    }), ',');
+
+    // seq, name, unique, origin, partial
+    for_each_schema_row(m_database, "PRAGMA index_list(" + table->m_name + ");", "", [&](sqlite3_stmt* stmt) {
+        uva::database::table::index_definition index;
+        index.name    = column_text(stmt, 1);
+        index.unique  = sqlite3_column_int(stmt, 2);
+        index.partial = sqlite3_column_int(stmt, 4);
+
+        table->m_indexes.push_back(std::move(index));
+    });
+
+    for(auto& index : table->m_indexes) {
+        // seqno, cid, name. The name is null for expressions.
+        for_each_schema_row(m_database, "PRAGMA index_info(" + index.name + ");", "", [&](sqlite3_stmt* stmt) {
+            index.columns.push_back(column_text(stmt, 2));
+        });
+
+        // Automatic indexes (UNIQUE and PRIMARY KEY constraints) have no SQL.
+        for_each_schema_row(m_database, "SELECT sql FROM sqlite_schema WHERE type = 'index' AND name = ?;", index.name, [&](sqlite3_stmt* stmt) {
+            index.sql = column_text(stmt, 0);
+        });
+    }
+
+    table->update_default_scope();
+}
+
+void uva::database::sqlite3_connection::load_schema()
+{
+    clear_statements();
+
+    std::vector<std::string> names;
+
+    for_each_schema_row(m_database, "SELECT name FROM sqlite_schema WHERE type = 'table' AND name NOT LIKE 'sqlite_%';", "", [&](sqlite3_stmt* stmt) {
+        names.push_back(column_text(stmt, 0));
+    });
+
+    for(const std::string& name : names) {
+        uva::database::table* table = uva::database::table::find_table(name);
+
+        if(table) {
+            read_schema(table);
+        } else {
+            uva::database::table::get_table(name);
+        }
+    }
+}
+
+void uva::database::sqlite3_connection::begin_transaction() 
+{
+    active_record_relation().commit("BEGIN TRANSACTION;");
+    s_thread_in_transaction = true;
+}
+
+void uva::database::sqlite3_connection::end_transaction() 
+{
+    s_thread_in_transaction = false;
+    active_record_relation().commit("END TRANSACTION;");
+}
+
+void uva::database::sqlite3_connection::rollback_transaction()
+{
+    s_thread_in_transaction = false;
+
+    // SQLite may have rolled back already (e.g. on SQLITE_FULL), ROLLBACK would then fail.
+    if(!sqlite3_get_autocommit(m_database)) {
+        active_record_relation().commit("ROLLBACK TRANSACTION;");
+    }
+}
+
+//END SQLITE3 CONNECTION
+
+//TEMPLATE DATABASE
+
+uva::database::template_database::template_database(const std::filesystem::path& path)
+    : m_path(path)
+{
+    // The migrations below write the columns and indexes of the shared tables.
+    if(connection_scope::active_in_other_threads()) {
+        throw std::runtime_error("template databases must be built before other threads use connection scopes");
+    }
+
+    m_connection = std::make_unique<sqlite3_connection>(basic_connection::detached);
+
+    connection_scope scope(m_connection.get());
+
+    m_connection->open(path);
+    basic_migration::do_pending_migrations();
+
+    sqlite3_int64 size = 0;
+    unsigned char* image = sqlite3_serialize(m_connection->get_database(), "main", &size, 0);
+
+    if(!image) {
+        throw std::runtime_error(std::format("unable to serialize template database {}", path.string()));
+    }
+
+    m_image.assign(image, image + size);
+    sqlite3_free(image);
+}
+
+std::unique_ptr<uva::database::sqlite3_connection> uva::database::template_database::clone(clone_mode mode, const std::filesystem::path& path) const
+{
+    std::unique_ptr<sqlite3_connection> connection = std::make_unique<sqlite3_connection>(basic_connection::detached);
+
+    // The clone has the schema of the template, already read by its constructor. Reading it again would
+    // write the shared tables while other threads query them.
+
+    switch(mode)
+    {
+        case clone_mode::file:
+            if(path.empty()) {
+                throw std::runtime_error("clone_mode::file requires a path");
+            }
+
+            std::filesystem::copy_file(m_path, path, std::filesystem::copy_options::overwrite_existing);
+            connection->open(path, false);
+        break;
+        case clone_mode::backup: {
+            connection->open(":memory:", false);
+
+            sqlite3_backup* backup = sqlite3_backup_init(connection->get_database(), "main", m_connection->get_database(), "main");
+
+            if(!backup) {
+                throw std::runtime_error(sqlite3_errmsg(connection->get_database()));
+            }
+
+            sqlite3_backup_step(backup, -1);
+
+            if(sqlite3_backup_finish(backup) != SQLITE_OK) {
+                throw std::runtime_error(sqlite3_errmsg(connection->get_database()));
+            }
+        }
+        break;
+        case clone_mode::deserialize: {
+            connection->open(":memory:", false);
+
+            // SQLite owns and frees the buffer, it must come from sqlite3_malloc.
+            unsigned char* image = (unsigned char*)sqlite3_malloc64(m_image.size());
+
+            if(!image) {
+                throw std::bad_alloc();
+            }
+
+            memcpy(image, m_image.data(), m_image.size());
+
+            if(sqlite3_deserialize(connection->get_database(), "main", image, m_image.size(), m_image.size(), SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE) != SQLITE_OK) {
+                throw std::runtime_error(sqlite3_errmsg(connection->get_database()));
+            }
+        }
+        break;
+    }
+
+    return connection;
+}
+
+//END TEMPLATE DATABASE
+
+//ROW VIEW
+
+uva::database::row_view::row_view(sqlite3_stmt* stmt, const std::vector<std::string>& names)
+    : m_stmt(stmt), m_names(&names)
+{
+
+}
+
+size_t uva::database::row_view::index(std::string_view name) const
+{
+    for(size_t column = 0; column < m_names->size(); ++column) {
+        if((*m_names)[column] == name) {
+            return column;
+        }
+    }
+
+    throw std::out_of_range(std::format("row has no column named {}", name));
+}
+
+bool uva::database::row_view::is_null(size_t column) const
+{
+    return sqlite3_column_type(m_stmt, (int)column) == SQLITE_NULL;
+}
+
+std::string_view uva::database::row_view::text(size_t column) const
+{
+    // Text must be read before asking for its size.
+    const char* value = (const char*)sqlite3_column_text(m_stmt, (int)column);
+
+    if(!value) {
+        return std::string_view();
+    }
+
+    return std::string_view(value, sqlite3_column_bytes(m_stmt, (int)column));
+}
+
+std::string_view uva::database::row_view::blob(size_t column) const
+{
+    const char* value = (const char*)sqlite3_column_blob(m_stmt, (int)column);
+
+    if(!value) {
+        return std::string_view();
+    }
+
+    return std::string_view(value, sqlite3_column_bytes(m_stmt, (int)column));
+}
+
+int64_t uva::database::row_view::integer(size_t column) const
+{
+    return sqlite3_column_int64(m_stmt, (int)column);
+}
+
+double uva::database::row_view::real(size_t column) const
+{
+    return sqlite3_column_double(m_stmt, (int)column);
+}
+
+//END ROW VIEW
+
+//BLOB STREAM
+
+uva::database::blob_stream::blob_stream(uva::database::table* table, const std::string& column, size_t id, bool writable)
+    : m_table(table), m_id(id)
+{
+    sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+
+    int error = sqlite3_blob_open(connection->get_database(), "main", table->m_name.c_str(), column.c_str(), id, writable, &m_blob);
+
+    if(error) {
+        std::string error_report = sqlite3_errmsg(connection->get_database());
+        // A handle is returned even on some errors and must be closed.
+        sqlite3_blob_close(m_blob);
+        m_blob = nullptr;
+        throw std::runtime_error(error_report);
+    }
+}
+
+uva::database::blob_stream::~blob_stream()
+{
+    sqlite3_blob_close(m_blob);
+}
+
+size_t uva::database::blob_stream::size() const
+{
+    return sqlite3_blob_bytes(m_blob);
+}
+
+void uva::database::blob_stream::seek(size_t offset)
+{
+    if(offset > size()) {
+        throw std::out_of_range(std::format("offset {} is past the end of a blob with {} bytes", offset, size()));
+    }
+
+    m_offset = offset;
+}
+
+size_t uva::database::blob_stream::read(void* buffer, size_t size)
+{
+    size = std::min(size, this->size() - m_offset);
+
+    if(!size) {
+        return 0;
+    }
+
+    if(sqlite3_blob_read(m_blob, buffer, (int)size, (int)m_offset)) {
+        sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+        throw std::runtime_error(sqlite3_errmsg(connection->get_database()));
+    }
+
+    m_offset += size;
+
+    return size;
+}
+
+void uva::database::blob_stream::write(const void* buffer, size_t size)
+{
+    if(sqlite3_blob_write(m_blob, buffer, (int)size, (int)m_offset)) {
+        sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+        throw std::runtime_error(sqlite3_errmsg(connection->get_database()));
+    }
+
+    m_offset += size;
+
+    // Incremental writes do not call the update hook.
+    if(m_table->m_cached) {
+        m_table->invalidate_relation(m_id);
+    }
+}
+
+void uva::database::blob_stream::reopen(size_t id)
+{
+    if(sqlite3_blob_reopen(m_blob, id)) {
+        sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+        throw std::runtime_error(sqlite3_errmsg(connection->get_database()));
+    }
+
+    m_id = id;
+    m_offset = 0;
+}
+
+//END BLOB STREAM
+
+std::string& uva::database::table::at(size_t id, const std::string& key) {
+    sync_relations();
+    auto it = m_relations.find(id);
+
+    if (it == m_relations.end()) {
+        throw std::out_of_range(m_name + " do not contains a record with id " + std::to_string(id));
+    }
+
+    auto colIt = it->second.find(key);
+
+    if (colIt == it->second.end()) {
+        throw std::out_of_range(m_name + " do not contains a column with name " + key);
+    }
+
+    return colIt->second;
+}
+
+void uva::database::table::add_column(const std::string& name, const std::string& type, const std::string& default_value) {
+
+    uva::database::basic_connection::get_connection()->add_column(this, name, type, default_value);
+
+}
+
+void uva::database::table::change_column(const std::string& name, const std::string& type) {
+
+    uva::database::basic_connection::get_connection()->change_column(this, name, type);
+
+}
+
+//TABLE
+
+uva::database::table::table(const std::string& name, const std::vector<std::pair<std::string, std::string>>& cols)
+    : m_name(name), m_columns(cols)
+{
+    uva::database::table::add_table(this);
+}
+
+uva::database::table::table(const std::string& name)
+    : m_name(name)
+{
+    uva::database::table::add_table(this);
+}
+
+static std::shared_mutex s_tables_mutex;
+static std::mutex s_tables_creation_mutex;
+
+std::unordered_map<std::string, uva::database::table*>& uva::database::table::get_tables()
+{
+    static std::unordered_map<std::string, table*> s_tables;
+    return s_tables;
+}
+
+void uva::database::table::add_table(uva::database::table* table)
+{
+    std::unique_lock lock(s_tables_mutex);
+    get_tables().insert({table->m_name, table});
+}
+
+uva::database::table* uva::database::table::find_table(const std::string& name)
+{
+    std::shared_lock lock(s_tables_mutex);
+
+    auto& tables = get_tables();
+    auto it = tables.find(name);
+
+    return it != tables.end() ? it->second : nullptr;
+}
+
+uva::database::table* uva::database::table::get_table(const std::string& name) {
+
+    uva::database::table* table = find_table(name);
+
+    if(table) {
+        return table;
+    }
+
+    // Creation is serialized so a name is only ever created once. Lookups are not blocked by it.
+    std::lock_guard creation_lock(s_tables_creation_mutex);
+
+    table = find_table(name);
+
+    if(table) {
+        return table;
+    }
+
+    uva::database::basic_connection* connection = uva::database::basic_connection::get_connection();
+    uva::database::table* created = nullptr;
+
+    if(name == "database_migrations") {
+        created = new uva::database::table("database_migrations",
+        {
+            { "id",         "INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL" },
+            { "title",      "TEXT NOT NULL" },
+            { "updated_at", "INTEGER DEFAULT (STRFTIME('%s'))" },
+            { "created_at", "INTEGER DEFAULT (STRFTIME('%s'))" },
+            { "removed",    "INTEGER DEFAULT 0" },    
+        });
+
+        //The table is only created if not exists. Without a connection yet, do_pending_migrations creates it.
+        if(connection) {
+            connection->create_table(created);
+            connection->read_schema(created);
+        }
+    } else {
+        created = new uva::database::table(name);
+
+        if(connection) {
+            connection->read_schema(created);
+        }
+    }
+
+    return created;
+}
+
+size_t uva::database::table::create(const std::map<std::string, var>& relations)
+{
+    auto keys_values = uva::string::split(relations);
+
+    auto relation = uva::database::active_record_relation(this).insert(keys_values.second).columns(keys_values.first).into(m_name).returning("id").unscoped();
+    relation.commit_without_prepare(relation.to_sql());
+
+    return relation[0]["id"].to_i();
+}
+
+void uva::database::table::create(std::vector<var>& relations, const std::vector<std::string>& columns)
+{
+    var rows = std::move(relations);
+
+    auto relation = uva::database::active_record_relation(this).insert(rows).columns(columns).into(m_name).unscoped();
+    relation.commit_without_prepare(relation.to_sql());
+}
+
+void uva::database::table::create(var& rows, const std::vector<std::string>& columns)
+{
+    auto relation = uva::database::active_record_relation(this).insert(rows).columns(columns).into(m_name).unscoped();
+    relation.commit_without_prepare(relation.to_sql());
+}
+
+void uva::database::table::create(std::vector<std::map<std::string, var>>& relations)
+{
+    std::vector<std::string> keys;
+    std::vector<var> values;
+
+    for(auto& row : relations)
+    {
+        auto keys_values = uva::string::split(row);
+        row.clear();
+
+        if(keys.empty()) {
+            keys = keys_values.first;
+        } else {
+            #if UVA_DEBUG_LEVEL > 3
+                bool keys_match = keys.size() == keys_values.first.size() && std::equal(keys.begin(), keys.end(), keys_values.first.begin());
+
+                if(!keys_match) {
+                    throw std::runtime_error("Wrong number of arguments");
+                    return;
+                }
+            #endif
+        }
+
+        values.insert(values.end(), keys_values.second.begin(), keys_values.second.end());
+    }
+
+    auto relation = uva::database::active_record_relation(this).insert(values).columns(keys).into(m_name).unscoped();
+    relation.commit_without_prepare(relation.to_sql());
+}
+
+void uva::database::table::create(std::vector<std::vector<var>>& values, const std::vector<std::string>& columns)
+{
+    auto relation = uva::database::active_record_relation(this).insert(values).columns(columns).into(m_name).unscoped();
+    relation.commit_without_prepare(relation.to_sql());
+}
+
+size_t uva::database::table::create() {
+    std::map<std::string, std::string> empty_relations;
+    for (const auto& row : m_columns) {
+        empty_relations.insert({ row.first, { "" } });
+    }
+    //return create(empty_relations);
+    return 0;
+}
+
+void uva::database::table::destroy(size_t id) {
+    uva::database::basic_connection::get_connection()->destroy(id, this);
+}
+
+bool uva::database::table::relation_exists(size_t id) {
+    sync_relations();
+    return m_relations.find(id) != m_relations.end();
+}
+
+size_t uva::database::table::find(size_t id) {
+    if (id == std::string::npos) return std::string::npos;
+    sync_relations();
+    auto it = m_relations.find(id);
+
+    return it != m_relations.end() ? it->first : std::string::npos;
+}
+
+static std::string hash_cache_key(const uva::database::table::cache_index& index, const std::map<std::string, std::string>& relation)
+{
+    std::string key;
+
+    for(const std::string& column : index.columns) {
+        auto it = relation.find(column);
+        if(it != relation.end()) {
+            key += it->second;
+        }
+        key.push_back('\x1f');
+    }
+
+    return key;
+}
+
+static std::vector<std::string> sorted_cache_key(const uva::database::table::cache_index& index, const std::map<std::string, std::string>& relation)
+{
+    std::vector<std::string> key;
+    key.reserve(index.columns.size());
+
+    for(const std::string& column : index.columns) {
+        auto it = relation.find(column);
+        key.push_back(it != relation.end() ? it->second : std::string());
+    }
+
+    return key;
+}
+
+size_t uva::database::table::find_by(const std::map<std::string, std::string>& relations)
+{
+    sync_relations();
+
+    for(const cache_index& index : m_cache_indexes) {
+        if(index.type == cache_index_type::hash) {
+            if(index.columns.size() != relations.size()) {
+                continue;
+            }
+
+            bool covered = std::all_of(index.columns.begin(), index.columns.end(), [&](const std::string& column) {
+                return relations.contains(column);
+            });
+
+            if(!covered) {
+                continue;
+            }
+
+            auto it = index.hashed.find(hash_cache_key(index, relations));
+            return it != index.hashed.end() ? *it->second.begin() : std::string::npos;
+        } else {
+            if(index.columns.size() < relations.size()) {
+                continue;
+            }
+
+            std::vector<std::string> prefix;
+            prefix.reserve(relations.size());
+
+            for(size_t i = 0; i < relations.size(); ++i) {
+                auto it = relations.find(index.columns[i]);
+                if(it == relations.end()) {
+                    break;
+                }
+                prefix.push_back(it->second);
+            }
+
+            if(prefix.size() != relations.size()) {
+                continue;
+            }
+
+            // Several keys can share the prefix, the lowest id among them is the first record.
+            size_t id = std::string::npos;
+            cache_key_less less = index.sorted.key_comp();
+
+            for(auto it = index.sorted.lower_bound(prefix); it != index.sorted.end(); ++it) {
+                std::vector<std::string> key_prefix(it->first.begin(), it->first.begin() + prefix.size());
+                if(less(prefix, key_prefix)) {
+                    break;
+                }
+                id = std::min(id, *it->second.begin());
+            }
+
+            return id;
+        }
+    }
+
+    for (const auto& record : m_relations) {
+        bool match = true;
+        for (const auto& relation : relations) {
+            auto it = record.second.find(relation.first);
+            if (it == record.second.end() || relation.second != it->second) {
+                match = false;
+                break;
+            }            
+        }
+        if (match) return record.first;
+    }
+
+    return std::string::npos;
+}
+
+size_t uva::database::table::first() {
+    sync_relations();
+    auto it = m_relations.begin();
+    return it != m_relations.end() ? it->first : std::string::npos;
+}
+
+size_t uva::database::table::last() {
+    sync_relations();
+    auto it = m_relations.rbegin();
+    return it != m_relations.rend() ? it->first : std::string::npos;
+}
+
+std::vector<size_t> uva::database::table::find_range(const std::vector<std::string>& columns, const std::vector<std::string>& from, const std::vector<std::string>& to)
+{
+    if(from.size() > columns.size() || to.size() > columns.size()) {
+        throw std::runtime_error(std::format("find_range on table {} takes at most {} values per bound", m_name, columns.size()));
+    }
+
+    sync_relations();
+
+    for(const cache_index& index : m_cache_indexes) {
+        if(index.type != cache_index_type::sorted || index.columns.size() < columns.size()) {
+            continue;
+        }
+
+        if(!std::equal(columns.begin(), columns.end(), index.columns.begin())) {
+            continue;
+        }
+
+        std::vector<size_t> ids;
+        cache_key_less less = index.sorted.key_comp();
+
+        for(auto it = index.sorted.lower_bound(from); it != index.sorted.end(); ++it) {
+            std::vector<std::string> key_prefix(it->first.begin(), it->first.begin() + to.size());
+            if(less(to, key_prefix)) {
+                break;
+            }
+            ids.insert(ids.end(), it->second.begin(), it->second.end());
+        }
+
+        return ids;
+    }
+
+    throw std::runtime_error(std::format("table {} has no sorted cache index starting with ({})", m_name, uva::string::join(columns, ',')));
+}
+
+static bool parse_cache_number(const std::string& value, double& number)
+{
+    if(value.empty()) {
+        return false;
+    }
+
+    const char* end = value.data() + value.size();
+    auto result = std::from_chars(value.data(), end, number);
+
+    // NaN is not ordered, it would break the ordering std::map relies on.
+    return result.ec == std::errc() && result.ptr == end && !std::isnan(number);
+}
+
+bool uva::database::cache_key_less::operator()(const std::vector<std::string>& lhs, const std::vector<std::string>& rhs) const
+{
+    size_t size = std::min(lhs.size(), rhs.size());
+
+    for(size_t i = 0; i < size; ++i) {
+        double lhs_number;
+        double rhs_number;
+
+        bool numeric_column = i < numeric.size() && numeric[i];
+        bool lhs_numeric = numeric_column && parse_cache_number(lhs[i], lhs_number);
+        bool rhs_numeric = numeric_column && parse_cache_number(rhs[i], rhs_number);
+
+        if(lhs_numeric && rhs_numeric) {
+            if(lhs_number != rhs_number) {
+                return lhs_number < rhs_number;
+            }
+        } else if(lhs_numeric != rhs_numeric) {
+            // An empty string is a null and sorts before numbers.
+            if(lhs[i].empty() || rhs[i].empty()) {
+                return lhs[i].empty();
+            }
+            return lhs_numeric;
+        } else {
+            int compare = lhs[i].compare(rhs[i]);
+            if(compare) {
+                return compare < 0;
+            }
+        }
+    }
+
+    return lhs.size() < rhs.size();
+}
+
+void uva::database::table::add_cache_index(const std::vector<std::string>& columns, cache_index_type type)
+{
+    sync_relations();
+
+    cache_index index;
+    index.columns = columns;
+    index.type = type;
+
+    cache_key_less less;
+
+    for(const std::string& column : columns) {
+        var::var_type column_type = this->column_type(column);
+        less.numeric.push_back(column_type == var::var_type::integer || column_type == var::var_type::real);
+    }
+
+    index.sorted = decltype(index.sorted)(less);
+
+    m_cache_indexes.push_back(std::move(index));
+
+    for(const auto& relation : m_relations) {
+        index_relation(relation.first, relation.second);
+    }
+}
+
+void uva::database::table::index_relation(size_t id, const std::map<std::string, std::string>& relation)
+{
+    for(cache_index& index : m_cache_indexes) {
+        if(index.type == cache_index_type::hash) {
+            std::string key = hash_cache_key(index, relation);
+            index.hashed[key].insert(id);
+        } else {
+            std::vector<std::string> key = sorted_cache_key(index, relation);
+            index.sorted[key].insert(id);
+        }
+    }
+}
+
+void uva::database::table::unindex_relation(size_t id, const std::map<std::string, std::string>& relation)
+{
+    for(cache_index& index : m_cache_indexes) {
+        if(index.type == cache_index_type::hash) {
+            std::string key = hash_cache_key(index, relation);
+
+            auto it = index.hashed.find(key);
+            if(it != index.hashed.end()) {
+                it->second.erase(id);
+                if(it->second.empty()) {
+                    index.hashed.erase(it);
+                }
+            }
+        } else {
+            std::vector<std::string> key = sorted_cache_key(index, relation);
+
+            auto it = index.sorted.find(key);
+            if(it != index.sorted.end()) {
+                it->second.erase(id);
+                if(it->second.empty()) {
+                    index.sorted.erase(it);
+                }
+            }
+        }
+    }
+}
+
+void uva::database::table::insert_relation(size_t id, std::map<std::string, std::string>&& relation)
+{
+    index_relation(id, relation);
+    m_relations.insert({ id, std::move(relation) });
+}
+
+void uva::database::table::erase_relation(size_t id)
+{
+    auto it = m_relations.find(id);
+
+    if(it != m_relations.end()) {
+        unindex_relation(id, it->second);
+        m_relations.erase(it);
+    }
+}
+
+std::vector<uva::database::table*>& uva::database::table::get_cached_tables()
+{
+    static std::vector<table*> s_cached_tables;
+    return s_cached_tables;
+}
+
+std::mutex& uva::database::table::get_cached_tables_mutex()
+{
+    static std::mutex s_cached_tables_mutex;
+    return s_cached_tables_mutex;
+}
+
+void uva::database::table::cache()
+{
+    // SQLite calls the update hook for rowid tables only.
+    if(m_without_rowid) {
+        throw std::runtime_error(std::format("cannot cache {}, it is a WITHOUT ROWID table", m_name));
+    }
+
+    m_cache_connection = uva::database::basic_connection::get_connection();
+
+    {
+        std::lock_guard lock(get_cached_tables_mutex());
+
+        if(!m_cached) {
+            m_cached = true;
+            get_cached_tables().push_back(this);
+        }
+    }
+
+    // Statements prepared before were authorized without the table being cached.
+    if(m_cache_connection) {
+        ((sqlite3_connection*)m_cache_connection)->clear_statements();
+    }
+
+    load_relations();
+}
+
+static std::map<std::string, std::string> relation_to_strings(const std::map<std::string, var>& row)
+{
+    std::map<std::string, std::string> relation;
+
+    for(const auto& value : row) {
+        relation.insert({ value.first, value.second.is_null() ? std::string() : value.second.to_s() });
+    }
+
+    return relation;
+}
+
+void uva::database::table::load_relations()
+{
+    // Cleared before reading, so rows written meanwhile are synced again instead of lost.
+    {
+        std::lock_guard lock(m_stale_relations_mutex);
+        m_stale_relations.clear();
+    }
 
-    auto it = table->find_column(name);
+    auto relation = uva::database::active_record_relation(this).select("*").from(m_name).unscoped();
+    relation.commit();
 
-    it->second = type;
+    m_relations.clear();
 
-    for (const auto& row : table->m_columns)
-    {
-        cols_definitions += ", " + row.first + " " + row.second;
-    }    
+    for(cache_index& index : m_cache_indexes) {
+        index.hashed.clear();
+        index.sorted.clear();
+    }
 
-    std::string new_definition = table->m_name + "(" + cols_definitions + ")";
+    for(size_t i = 0; i < relation.results().size(); ++i) {
+        std::map<std::string, var> row = relation[i];
+        size_t id = row["id"].to_i();
 
-    alter_table(table, new_definition);
+        insert_relation(id, relation_to_strings(row));
+    }
 }
 
-void uva::database::sqlite3_connection::begin_transaction() 
+void uva::database::table::invalidate_relation(size_t id)
 {
-    active_record_relation().commit("BEGIN TRANSACTION;");
-    enable_query_cout_printing = false;
+    std::lock_guard lock(m_stale_relations_mutex);
+    m_stale_relations.insert(id);
 }
 
-void uva::database::sqlite3_connection::end_transaction() 
+void uva::database::table::sync_relations()
 {
-    enable_query_cout_printing = enable_query_cout_printing_default;
-    active_record_relation().commit("END TRANSACTION;");
-}
-
-//END SQLITE3 CONNECTION
-
-std::string& uva::database::table::at(size_t id, const std::string& key) {
-    auto it = m_relations.find(id);
-
-    if (it == m_relations.end()) {
-        throw std::out_of_range(m_name + " do not contains a record with id " + std::to_string(id));
+    if(!m_cached) {
+        return;
     }
 
-    auto colIt = it->second.find(key);
+    std::set<size_t> stale;
 
-    if (colIt == it->second.end()) {
-        throw std::out_of_range(m_name + " do not contains a column with name " + key);
+    {
+        std::lock_guard lock(m_stale_relations_mutex);
+        stale.swap(m_stale_relations);
     }
 
-    return colIt->second;
-}
+    if(stale.empty()) {
+        return;
+    }
 
-void uva::database::table::add_column(const std::string& name, const std::string& type, const std::string& default_value) {
+    // After a bulk write it is cheaper to read the table again than to list every id.
+    if(stale.size() > m_relations.size() / 2 + 64) {
+        load_relations();
+        return;
+    }
 
-    uva::database::basic_connection::get_connection()->add_column(this, name, type, default_value);
+    std::string ids = uva::string::join(uva::string::join(stale, [](const size_t& id) {
+        return std::to_string(id);
+    }), ',');
 
-}
+    auto relation = uva::database::active_record_relation(this).select("*").from(m_name).where("id IN ({})", ids).unscoped();
+    relation.commit();
 
-void uva::database::table::change_column(const std::string& name, const std::string& type) {
+    // Deleted rows are not returned, so every stale row is dropped before reinserting the fresh ones.
+    for(const size_t& id : stale) {
+        erase_relation(id);
+    }
 
-    uva::database::basic_connection::get_connection()->change_column(this, name, type);
+    for(size_t i = 0; i < relation.results().size(); ++i) {
+        std::map<std::string, var> row = relation[i];
+        size_t id = row["id"].to_i();
 
+        insert_relation(id, relation_to_strings(row));
+    }
 }
 
-//TABLE
-
-uva::database::table::table(const std::string& name, const std::vector<std::pair<std::string, std::string>>& cols)
-    : m_name(name), m_columns(cols)
+const var::var_type& uva::database::table::column_type(const std::string& col) const
 {
-    uva::database::table::add_table(this);
+    return m_columns_types[find_column(col) - m_columns.begin()];
 }
 
-uva::database::table::table(const std::string& name)
-    : m_name(name)
-{
-    uva::database::table::add_table(this);
+std::vector<std::pair<std::string, std::string>>::iterator uva::database::table::find_column(const std::string& col) {
+    auto it = std::find_if(m_columns.begin(), m_columns.end(), [&col](const std::pair<std::string, std::string>& pair) { return pair.first == col; });
+    if (it == m_columns.end()) {        
+        throw std::out_of_range("There is no column named '" + col + "' in table '" + m_name + "'");
+    }
+    return it;
 }
 
-std::map<std::string, uva::database::table*>& uva::database::table::get_tables()
-{
-    static std::map<std::string, table*> s_tables;
-    return s_tables;
+std::vector<std::pair<std::string, std::string>>::const_iterator uva::database::table::find_column(const std::string& col) const {
+    auto it = std::find_if(m_columns.begin(), m_columns.end(), [&col](const std::pair<std::string, std::string>& pair) { return pair.first == col; });
+    if (it == m_columns.end()) {
+        throw std::out_of_range("There is no column named '" + col + "' in table '" + m_name + "'");
+    }
+    return it;
 }
 
-void uva::database::table::add_table(uva::database::table* table)
+void uva::database::table::update(size_t id, const std::map<std::string, var>& values)
 {
-    auto tables = get_tables();
-    tables.insert({table->m_name, table});
+    active_record_relation(this).where("id = {}", id).unscoped().update(values);
 }
 
-uva::database::table* uva::database::table::get_table(const std::string& name) {
-
-    auto tables = get_tables();
+void uva::database::table::update(size_t id, const std::string& key, const std::string& value) {
+    update(id, { { key, value } });
+}
 
-    auto it = tables.find(name);
+std::string uva::database::table::key_condition(const std::map<std::string, var>& row) const
+{
+    std::vector<std::string> conditions;
 
-    if (it == tables.end()) {
+    for(const std::string& column : primary_key_columns()) {
+        auto it = row.find(column);
 
-        if(name == "database_migrations") {
-            uva::database::table * info_table = new uva::database::table("database_migrations",
-            {
-                { "id",         "INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL" },
-                { "title",      "TEXT NOT NULL" },
-                { "updated_at", "INTEGER DEFAULT (STRFTIME('%s'))" },
-                { "created_at", "INTEGER DEFAULT (STRFTIME('%s'))" },
-                { "removed",    "INTEGER DEFAULT 0" },    
-            });
+        if(it == row.end() || it->second.is_null()) {
+            throw std::runtime_error(std::format("cannot identify a row of {} without {}", m_name, column));
+        }
 
-            //The table is only created if not exists
-            uva::database::basic_connection::get_connection()->create_table(info_table);
+        std::string value = it->second.to_s();
 
-            return info_table;
-        } else {
-            return new uva::database::table(name);
+        if(it->second.type == var::var_type::string) {
+            value = uva::string::prefix_sufix(value, "'", "'");
         }
 
-        //throw
-        return nullptr;
+        conditions.push_back(column + " = " + value);
     }
 
-    return it->second;
+    return uva::string::join(conditions, " AND ");
 }
 
-size_t uva::database::table::create(const std::map<std::string, var>& relations)
+void uva::database::table::update_row(const std::map<std::string, var>& row, const std::map<std::string, var>& values)
 {
-    auto keys_values = uva::string::split(relations);
-
-    auto relation = uva::database::active_record_relation(this).insert(keys_values.second).columns(keys_values.first).into(m_name).returning("id").unscoped();
-    relation.commit_without_prepare(relation.to_sql());
-
-    return relation[0]["id"].to_i();
+    active_record_relation(this).where("{}", key_condition(row)).unscoped().update(values);
 }
 
-void uva::database::table::create(std::vector<var>& relations, const std::vector<std::string>& columns)
+void uva::database::table::destroy_row(const std::map<std::string, var>& row)
 {
-    var rows = std::move(relations);
-
-    auto relation = uva::database::active_record_relation(this).insert(rows).columns(columns).into(m_name).unscoped();
-    relation.commit_without_prepare(relation.to_sql());
+    active_record_relation(this).commit_without_prepare(std::format("DELETE FROM {} WHERE {};", m_name, key_condition(row)));
 }
 
-void uva::database::table::create(var& rows, const std::vector<std::string>& columns)
+static bool has_or_operator(const std::string& where);
+
+void uva::database::table::set_default_scope(const std::string& scope)
 {
-    auto relation = uva::database::active_record_relation(this).insert(rows).columns(columns).into(m_name).unscoped();
-    relation.commit_without_prepare(relation.to_sql());
+    m_declared_default_scope = scope;
+    update_default_scope();
 }
 
-void uva::database::table::create(std::vector<std::map<std::string, var>>& relations)
+void uva::database::table::declare_default_scope(const char* scope)
 {
-    std::vector<std::string> keys;
-    std::vector<var> values;
-
-    for(auto& row : relations)
-    {
-        auto keys_values = uva::string::split(row);
-        row.clear();
-
-        if(keys.empty()) {
-            keys = keys_values.first;
-        } else {
-            #if UVA_DEBUG_LEVEL > 3
-                bool keys_match = keys.size() == keys_values.first.size() && std::equal(keys.begin(), keys.end(), keys_values.first.begin());
+    std::optional<std::string> declared;
 
-                if(!keys_match) {
-                    throw std::runtime_error("Wrong number of arguments");
-                    return;
-                }
-            #endif
-        }
+    if(scope) {
+        declared = scope;
+    }
 
-        values.insert(values.end(), keys_values.second.begin(), keys_values.second.end());
+    if(m_default_scope_declared && declared != m_declared_default_scope) {
+        throw std::runtime_error(std::format("models of table {} declare different default scopes", m_name));
     }
 
-    auto relation = uva::database::active_record_relation(this).insert(values).columns(keys).into(m_name).unscoped();
-    relation.commit_without_prepare(relation.to_sql());
-}
+    m_default_scope_declared = true;
+    m_declared_default_scope = std::move(declared);
 
-void uva::database::table::create(std::vector<std::vector<var>>& values, const std::vector<std::string>& columns)
-{
-    auto relation = uva::database::active_record_relation(this).insert(values).columns(columns).into(m_name).unscoped();
-    relation.commit_without_prepare(relation.to_sql());
+    update_default_scope();
 }
 
-size_t uva::database::table::create() {
-    std::map<std::string, std::string> empty_relations;
-    for (const auto& row : m_columns) {
-        empty_relations.insert({ row.first, { "" } });
+void uva::database::table::update_default_scope()
+{
+    if(m_declared_default_scope) {
+        // Kept as a single term, so the scope is not split by the AND joining it to the query conditions.
+        m_default_scope = has_or_operator(*m_declared_default_scope) ? "(" + *m_declared_default_scope + ")" : *m_declared_default_scope;
+        return;
     }
-    //return create(empty_relations);
-    return 0;
-}
 
-void uva::database::table::destroy(size_t id) {
+    bool soft_deletes = std::find_if(m_columns.begin(), m_columns.end(), [](const std::pair<std::string, std::string>& column) {
+        return column.first == "removed";
+    }) != m_columns.end();
 
+    m_default_scope = soft_deletes ? "removed = 0" : "";
 }
 
-bool uva::database::table::relation_exists(size_t id) const {
-    return m_relations.find(id) != m_relations.end();
-}
+std::vector<std::string> uva::database::table::primary_key_columns() const
+{
+    if(primary_key.empty()) {
+        return { "id" };
+    }
 
-size_t uva::database::table::find(size_t id) const {
-    if (id == std::string::npos) return std::string::npos;
-    auto it = m_relations.find(id);
+    std::vector<std::string> columns(1);
 
-    return std::string::npos;
+    for(char c : primary_key) {
+        if(c == ',') {
+            columns.emplace_back();
+        } else if(c != ' ') {
+            columns.back().push_back(c);
+        }
+    }
+
+    return columns;
 }
 
-size_t uva::database::table::find_by(const std::map<std::string, std::string>& relations)
+std::string uva::database::table::definition(const std::vector<std::pair<std::string, std::string>>& extra_columns) const
 {
-    for (const auto& record : m_relations) {
-        bool match = true;
-        for (const auto& relation : relations) {
-            if (relation.second != record.second.find(relation.first)->second) {
-                match = false;
-                break;
-            }            
+    std::string sql = m_name + "(";
+    bool inline_primary_key = false;
+
+    for(const auto* columns : { &m_columns, &extra_columns }) {
+        for(const auto& column : *columns) {
+            std::string upper = column.second;
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+            inline_primary_key |= upper.find("PRIMARY KEY") != std::string::npos;
+
+            sql += column.first + " " + column.second + ", ";
         }
-        if (match) return record.first;
     }
 
-    return std::string::npos;
-}
+    if(primary_key.size() && !inline_primary_key) {
+        sql += "PRIMARY KEY(" + primary_key + "), ";
+    }
 
-size_t uva::database::table::first() {
-    auto it = m_relations.begin();
-    return it != m_relations.end() ? it->first : std::string::npos;
-}
+    for(const std::string& constraint : m_constraints) {
+        sql += constraint + ", ";
+    }
 
-size_t uva::database::table::last() {
-    auto it = m_relations.rbegin();
-    return it != m_relations.rend() ? it->first : std::string::npos;
-}
+    sql.pop_back();
+    sql.pop_back();
 
-std::vector<std::pair<std::string, std::string>>::iterator uva::database::table::find_column(const std::string& col) {
-    auto it = std::find_if(m_columns.begin(), m_columns.end(), [&col](const std::pair<std::string, std::string>& pair) { return pair.first == col; });
-    if (it == m_columns.end()) {        
-        throw std::out_of_range("There is no column named '" + col + "' in table '" + m_name + "'");
+    sql += ")";
+
+    if(m_strict) {
+        sql += " STRICT";
     }
-    return it;
-}
 
-std::vector<std::pair<std::string, std::string>>::const_iterator uva::database::table::find_column(const std::string& col) const {
-    auto it = std::find_if(m_columns.begin(), m_columns.end(), [&col](const std::pair<std::string, std::string>& pair) { return pair.first == col; });
-    if (it == m_columns.end()) {
-        throw std::out_of_range("There is no column named '" + col + "' in table '" + m_name + "'");
+    if(m_without_rowid) {
+        sql += m_strict ? ", WITHOUT ROWID" : " WITHOUT ROWID";
     }
-    return it;
+
+    return sql;
 }
 
-void uva::database::table::update(size_t id, const std::map<std::string, var>& values)
+void uva::database::table::upsert(const std::map<std::string, var>& values)
 {
-    active_record_relation(this).unscoped().update(values);
-}
+    std::vector<std::string> keys = primary_key_columns();
+    std::map<std::string, var> writable;
 
-void uva::database::table::update(size_t id, const std::string& key, const std::string& value) {
-    update(id, { { key, value } });
+    for(const auto& value : values) {
+        // Records always have an id entry, which is null for tables keyed by other columns.
+        if(m_generated_columns.contains(value.first) || (value.first == "id" && value.second.is_null())) {
+            continue;
+        }
+
+        writable.insert(value);
+    }
+
+    auto keys_values = uva::string::split(writable);
+
+    std::string sql = active_record_relation(this).insert(keys_values.second).columns(keys_values.first).into(m_name).unscoped().to_sql();
+    sql.pop_back();
+
+    std::vector<std::string> assignments;
+
+    for(const auto& value : writable) {
+        if(std::find(keys.begin(), keys.end(), value.first) == keys.end()) {
+            assignments.push_back(value.first + " = excluded." + value.first);
+        }
+    }
+
+    sql += " ON CONFLICT(" + uva::string::join(keys, ',') + ")";
+    sql += assignments.empty() ? " DO NOTHING;" : " DO UPDATE SET " + uva::string::join(assignments, ", ") + ";";
+
+    active_record_relation(this).commit_without_prepare(sql);
 }
 
 //END TABLE
@@ -578,6 +3009,8 @@ uva::database::basic_active_record::basic_active_record(const basic_active_recor
     : values(_record.values)
 {
     id = at("id");
+    // Only after construction, loading columns needs get_table().
+    m_lazy_columns = _record.m_lazy_columns;
 }
 
 uva::database::basic_active_record::basic_active_record(basic_active_record&& _record)
@@ -585,6 +3018,7 @@ uva::database::basic_active_record::basic_active_record(basic_active_record&& _r
 {
     _record.id = 0;
     id = _record.id;
+    m_lazy_columns = _record.m_lazy_columns;
 }
 
 uva::database::basic_active_record::basic_active_record(const std::map<std::string, var>& _values)
@@ -614,17 +3048,25 @@ bool uva::database::basic_active_record::present() const {
         return false;
     }
 
-    auto it = values.find("id");
+    for(const std::string& key : get_table()->primary_key_columns()) {
+        auto it = values.find(key);
 
-    if(it == values.end()) {
-        return false;
+        if(it == values.end() || it->second.is_null()) {
+            return false;
+        }
+
+        bool has_value = it->second;
+
+        if(!has_value) {
+            return false;
+        }
     }
 
-    return it->second;
+    return true;
 }
 
 void uva::database::basic_active_record::destroy() {
-    get_table()->destroy(id);
+    get_table()->destroy_row(values);
     id = -1;
 }
 
@@ -632,12 +3074,17 @@ uva::database::basic_active_record& uva::database::basic_active_record::operator
 {
     values = other.values;
     id = other.id;
+    m_lazy_columns = other.m_lazy_columns;
     
     return *this;
 }
 
 var& uva::database::basic_active_record::at(const std::string& str)
 {
+    if(m_lazy_columns && values.find(str) == values.end()) {
+        load_missing_columns();
+    }
+
     var& value = values[str];
     return value;
 
@@ -674,54 +3121,143 @@ var& uva::database::basic_active_record::operator[](const char* str)
     return at(std::string(str));
 }
 
-const var& uva::database::basic_active_record::operator[](const char* str) const
-{
-    return at(std::string(str));
-}
+const var& uva::database::basic_active_record::operator[](const char* str) const
+{
+    return at(std::string(str));
+}
+
+std::string uva::database::basic_active_record::to_s() const
+{
+    std::string joined_values = uva::string::join(uva::string::join(values, [](const std::pair<std::string, var> & v){
+        return std::format("{}={}", v.first, v.second.to_s());
+    }), ", ");
+
+    return std::format("<{}Class> {{ {} }}", class_name(), joined_values);
+}
+
+void uva::database::basic_active_record::save()
+{
+    before_save();
+
+    const uva::database::table* table = get_table();
+
+    if(table->primary_key.size() && table->primary_key != "id") {
+        get_table()->upsert(values);
+        return;
+    }
+
+    auto it = values.find("id"); 
+
+    if(it == values.end() || it->second.is_null()) {
+       id = get_table()->create(values);
+    } else {
+        before_update();
+        get_table()->update(it->second, values);
+    }
+}
+
+void uva::database::basic_active_record::reload()
+{
+    uva::database::table* table = get_table();
+    std::map<var, var> key;
+
+    for(const std::string& column : table->primary_key_columns()) {
+        key[column] = at(column);
+    }
+
+    values = active_record_relation(table).select("*").from(table->m_name).unscoped().where(std::move(key));
+
+    for(auto& column : columns) {
+        update_exposed_column(column.first, column.second);
+    }
+}
+
+void uva::database::basic_active_record::load_missing_columns()
+{
+    m_lazy_columns = false;
+
+    uva::database::table* table = get_table();
+    std::vector<std::string> missing;
+
+    for(const auto& column : table->m_columns) {
+        if(values.find(column.first) == values.end()) {
+            missing.push_back(column.first);
+        }
+    }
+
+    if(missing.empty() || !present()) {
+        return;
+    }
+
+    std::map<var, var> key;
+
+    for(const std::string& column : table->primary_key_columns()) {
+        key[column] = values.find(column)->second;
+    }
+
+    std::map<std::string, var> loaded = active_record_relation(table).select(uva::string::join(missing, ',')).from(table->m_name).unscoped().where(std::move(key));
 
-std::string uva::database::basic_active_record::to_s() const
-{
-    std::string joined_values = uva::string::join(uva::string::join(values, [](const std::pair<std::string, var> & v){
-        return std::format("{}={}", v.first, v.second.to_s());
-    }), ", ");
+    for(auto& value : loaded) {
+        auto it = values.insert(std::move(value)).first;
+        auto column = columns.find(it->first);
 
-    return std::format("<{}Class> {{ {} }}", class_name(), joined_values);
+        if(column != columns.end()) {
+            update_exposed_column(it->first, column->second);
+        }
+    }
 }
 
-void uva::database::basic_active_record::save()
+std::vector<std::string> uva::database::basic_active_record::exposed_columns() const
 {
-    before_save();
-    
-    auto it = values.find("id"); 
+    const uva::database::table* table = get_table();
+    std::vector<std::string> names;
 
-    if(it == values.end() || it->second.is_null()) {
-       id = get_table()->create(values);
-    } else {
-        before_update();
-        get_table()->update(it->second, values);
+    auto add = [&](const std::string& name) {
+        bool in_table = std::find_if(table->m_columns.begin(), table->m_columns.end(), [&](const std::pair<std::string, std::string>& column) {
+            return column.first == name;
+        }) != table->m_columns.end();
+
+        if(in_table && std::find(names.begin(), names.end(), name) == names.end()) {
+            names.push_back(name);
+        }
+    };
+
+    for(const std::string& key : table->primary_key_columns()) {
+        add(key);
+    }
+
+    for(const auto& column : columns) {
+        add(column.first);
     }
+
+    return names;
 }
 
 void uva::database::basic_active_record::update(const std::string& col, const var& value)
 {
+    // The row is found by the key it had before the update, which may change it.
+    std::map<std::string, var> row = values;
+
     values[col] = value;
     before_update();
 
     uva::database::table* table = get_table();
-    table->update(values["id"], col, value);
+    table->update_row(row, { { col, value } });
 
     before_save();
 }
 
 void uva::database::basic_active_record::update(const std::map<std::string, var>& _values)
 {
+    std::map<std::string, var> row = values;
+
     for(const auto& value : _values) {
         values[value.first] = value.second;
     }
 
     before_update();
     
-    get_table()->update(values["id"], _values);
+    get_table()->update_row(row, _values);
 
     before_save();
 }
@@ -781,28 +3317,86 @@ uva::database::basic_active_record_column::~basic_active_record_column()
 //ACTIVE RECORD RELATION
 
 uva::database::active_record_relation::active_record_relation(uva::database::table* table)
-    : m_table(table)
 {
-    
+    edit().target = table;
+}
+
+const std::shared_ptr<uva::database::active_record_relation::query>& uva::database::active_record_relation::empty_query()
+{
+    // Never changed, edit() always clones it because this copy keeps it shared.
+    static const std::shared_ptr<query> empty = std::make_shared<query>();
+    return empty;
+}
+
+uva::database::active_record_relation::query& uva::database::active_record_relation::edit()
+{
+    if(m_query.use_count() != 1) {
+        m_query = std::make_shared<query>(*m_query);
+    }
+
+    return *m_query;
+}
+
+uva::database::active_record_relation::result_set& uva::database::active_record_relation::reset_result()
+{
+    m_result = std::make_shared<result_set>();
+    return *m_result;
+}
+
+const std::vector<std::vector<var>>& uva::database::active_record_relation::results() const
+{
+    static const std::vector<std::vector<var>> empty;
+    return m_result ? m_result->rows : empty;
 }
 
 void uva::database::active_record_relation::update(const std::map<std::string, var>& update)
 {
-    m_update = update;
+    edit().update = update;
     commit_without_prepare();
 
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::select(const std::string& select)
 {
-    m_select = select;
+    edit().select = select;
+
+    return *this;
+}
+
+uva::database::active_record_relation& uva::database::active_record_relation::only(const std::vector<std::string>& columns)
+{
+    // Records are reloaded, saved and lazily completed by their primary key.
+    std::vector<std::string> selected;
+
+    const uva::database::table* table = m_query->target;
+
+    if(table) {
+        // Tables with neither a primary key nor an id column have no key to select.
+        for(const std::string& key : table->primary_key_columns()) {
+            bool in_table = std::find_if(table->m_columns.begin(), table->m_columns.end(), [&](const std::pair<std::string, std::string>& column) {
+                return column.first == key;
+            }) != table->m_columns.end();
+
+            if(in_table) {
+                selected.push_back(key);
+            }
+        }
+    }
+
+    for(const std::string& column : columns) {
+        if(std::find(selected.begin(), selected.end(), column) == selected.end()) {
+            selected.push_back(column);
+        }
+    }
+
+    edit().select = uva::string::join(selected, ',');
 
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::from(const std::string& from)
 {
-    m_from = from;
+    edit().from = from;
 
     return *this;
 }
@@ -838,13 +3432,13 @@ std::map<std::string, var> uva::database::active_record_relation::where(std::map
 
 uva::database::active_record_relation &uva::database::active_record_relation::group_by(const std::string &group)
 {
-    m_group = group;
+    edit().group = group;
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::order_by(const std::string& order)
 {
-    m_order = order;
+    edit().order = order;
 
     return *this;
 }
@@ -858,19 +3452,19 @@ uva::database::active_record_relation& uva::database::active_record_relation::li
         }
     }
 
-    m_limit = limit;
+    edit().limit = limit;
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::limit(const size_t& limit)
 {
-    m_limit = std::to_string(limit);
+    edit().limit = std::to_string(limit);
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::insert(var& insert)
 {
-    m_insert = std::move(insert);
+    edit().insert = std::move(insert);
     return *this;
 }
 
@@ -878,37 +3472,39 @@ uva::database::active_record_relation& uva::database::active_record_relation::in
 {
     var v(std::move(insert));
 
-    m_insert.push_back(std::move(v));
+    edit().insert.push_back(std::move(v));
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::insert(std::vector<std::vector<var>>& __insert)
 {
-    m_insert.reserve(__insert.size());
+    var& rows = edit().insert;
+
+    rows.reserve(__insert.size());
     for(auto& insert : __insert)
     {
         var v = std::move(insert);
 
-        m_insert.push_back(std::move(v));
+        rows.push_back(std::move(v));
     }
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::columns(const std::vector<std::string>& columns)
 {
-    m_columns = columns;
+    edit().columns = columns;
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::into(const std::string& into)
 {
-    m_into = into;
+    edit().into = into;
     return *this;
 }
 
 uva::database::active_record_relation& uva::database::active_record_relation::returning(const std::string& returning)
 {
-    m_returning = returning;
+    edit().returning = returning;
     return *this;
 }
 
@@ -922,9 +3518,12 @@ std::vector<var> uva::database::active_record_relation::pluck(const std::string&
 
     rel.commit();
 
-    values.reserve(rel.m_results.size());
+    // rel committed last, so it is the only owner of its rows and they can be moved.
+    std::vector<std::vector<var>>& rows = rel.m_result->rows;
+
+    values.reserve(rows.size());
 
-    for(auto& value : rel.m_results)
+    for(auto& value : rows)
     {
         if(value.size() == 1) {
             values.push_back(std::move(value[0]));
@@ -947,21 +3546,22 @@ std::vector<std::vector<var>> uva::database::active_record_relation::pluckm(cons
 
     rel.commit();
 
-    return rel.m_results;
+    return std::move(rel.m_result->rows);
 }
 
 size_t uva::database::active_record_relation::count(const std::string& count) const
 {
     uva::database::active_record_relation count_relation = *this;
 
-    count_relation.m_select = "COUNT(" + count + ")";
+    count_relation.select("COUNT(" + count + ")");
 
     count_relation.commit();
 
     try {
-        auto first_row = count_relation.m_results.begin();
+        const auto& rows = count_relation.results();
+        auto first_row = rows.begin();
 
-        if(first_row == count_relation.m_results.end()) {
+        if(first_row == rows.end()) {
             return 0;
         }
 
@@ -984,8 +3584,10 @@ std::map<std::string, var> uva::database::active_record_relation::first()
 {
     uva::database::active_record_relation first_relation = *this;
 
-    if(!first_relation.m_order.size()) {
-        first_relation.order_by("id");
+    const uva::database::table* table = m_query->target;
+
+    if(!m_query->order.size()) {
+        first_relation.order_by(table && table->primary_key.size() ? table->primary_key : "id");
     }
 
     first_relation.limit(1);
@@ -1002,24 +3604,44 @@ void uva::database::active_record_relation::each_with_index(std::function<void(s
     size_t index = 0;
     size_t last_id = 0;
 
-    while(true) {
-        uva::database::active_record_relation copy = uva::database::active_record_relation(*this);
+    const std::string key = m_query->order || "id";
+    const size_t batch_size = std::max<size_t>(1, each_batch_size);
+
+    // A limit set by the caller bounds the rows of all the pages together. limit() only accepts digits.
+    size_t remaining = m_query->limit.size() ? std::stoull(m_query->limit) : std::numeric_limits<size_t>::max();
+
+    // Keyset pagination: one query per each_batch_size rows, without holding the whole table.
+    while(remaining) {
+        const size_t page_size = std::min(batch_size, remaining);
+
+        uva::database::active_record_relation page = uva::database::active_record_relation(*this);
 
         if(index) {
-            copy.where("{} > {}", m_order || "id", last_id).first();
+            page.where("{} > {}", key, last_id);
+        }
+
+        if(!m_query->order.size()) {
+            page.order_by(key);
         }
 
-        auto first = copy.first();
+        page.limit(page_size);
+        page.commit();
 
-        if(first.empty()) {
-            return;
-        } else {
-            last_id = first[m_order || "id"];
+        const size_t rows = page.results().size();
+        remaining -= rows;
+
+        for(size_t row = 0; row < rows; ++row) {
+            std::map<std::string, var> value = page[row];
+            last_id = value[key];
 
-            func(first, index);
+            func(value, index);
+
+            ++index;
         }
 
-        ++index;
+        if(rows < page_size) {
+            return;
+        }
     }
 }
 
@@ -1033,17 +3655,19 @@ void uva::database::active_record_relation::each(std::function<void(std::map<std
 bool uva::database::active_record_relation::empty()
 {
     commit();
-    return m_results.empty();
+    return m_result->rows.empty();
 }
 
 std::map<std::string, var> uva::database::active_record_relation::operator[](const size_t& index)
 {
+    stage_timer timer(profiler_stage::row_map);
+
     std::map<std::string, var> result;
 
-    auto row = m_results[index];
+    const auto& row = m_result->rows[index];
 
     auto col_it = row.begin();
-    for(const std::string& col : m_columnsNames) {
+    for(const std::string& col : m_result->columns_names) {
         result.insert({col,*col_it});
         col_it++;
     }
@@ -1055,7 +3679,7 @@ uva::database::active_record_relation uva::database::active_record_relation::uns
 {
     uva::database::active_record_relation unscoped = *this;
 
-    unscoped.m_unscoped = true;
+    unscoped.edit().unscoped = true;
 
     return unscoped;
 }
@@ -1064,27 +3688,51 @@ void uva::database::active_record_relation::append_where(const std::string& wher
 {
     //TODO: Remove previous columns values in m_where
 
-    if(m_where.size()) {
-        m_where += "AND " + where;
+    std::string& current = edit().where;
+
+    if(current.size()) {
+        current += " AND " + where;
     } else {
-        m_where = where;
+        current = where;
+    }
+}
+
+// Whether where has an OR outside of string literals.
+static bool has_or_operator(const std::string& where)
+{
+    bool quoted = false;
+
+    for(size_t i = 0; i + 1 < where.size(); ++i) {
+        if(where[i] == '\'') {
+            quoted = !quoted;
+        } else if(!quoted && (where[i] == 'O' || where[i] == 'o') && (where[i + 1] == 'R' || where[i + 1] == 'r')) {
+            bool word_start = i == 0 || !(isalnum((unsigned char)where[i - 1]) || where[i - 1] == '_');
+            bool word_end   = i + 2 == where.size() || !(isalnum((unsigned char)where[i + 2]) || where[i + 2] == '_');
+
+            if(word_start && word_end) {
+                return true;
+            }
+        }
     }
+
+    return false;
 }
 
-std::string sql_buffer;
+// Reused by commit_sql() to avoid an allocation per query, one per thread.
+static thread_local std::string sql_buffer;
 
 std::string uva::database::active_record_relation::commit_sql() const
 {
-    var arr = empty_array;
+    const query& q = *m_query;
 
     sql_buffer.clear();
     sql_buffer.reserve(query_buffer_lenght); 
 
-    if(m_update.size()) {
-        sql_buffer += "UPDATE " + m_table->m_name + " SET ";
+    if(q.update.size()) {
+        sql_buffer += "UPDATE " + q.target->m_name + " SET ";
 
         sql_buffer += uva::string::join(
-            uva::string::join(m_update, [](const auto& val) {
+            uva::string::join(q.update, [](const auto& val) {
                 std::string val_str = val.second.to_s();
                 if(val.second.type == var::var_type::string) {
                     val_str = uva::string::prefix_sufix(val_str, "'", "'");
@@ -1094,62 +3742,71 @@ std::string uva::database::active_record_relation::commit_sql() const
         ',');
     }
 
-    if(m_select.size() && !m_update.size()) {
-        sql_buffer += "SELECT " + m_select;
+    if(q.select.size() && !q.update.size()) {
+        sql_buffer += "SELECT " + q.select;
     }
 
-    if(m_from.size() && !m_update.size()) {
-        sql_buffer += " FROM " + m_from;
+    if(q.from.size() && !q.update.size()) {
+        sql_buffer += " FROM " + q.from;
     }
 
-    if(m_where.size()) {
-        sql_buffer += " WHERE " + m_where;
+    const std::string* scope = !q.unscoped && q.target && q.target->m_default_scope.size() ? &q.target->m_default_scope : nullptr;
+
+    if(q.where.size()) {
+        // "a OR b AND removed = 0" would only scope b. Parentheses also keep the scope a top level
+        // term, which SQLite needs to use partial indexes WHERE removed = 0.
+        if(scope && has_or_operator(q.where)) {
+            sql_buffer += " WHERE (" + q.where + ")";
+        } else {
+            sql_buffer += " WHERE " + q.where;
+        }
     }
 
-    if(!m_unscoped) {
-        sql_buffer += (m_where.size() ? " AND " : " WHERE ") + (std::string)"removed = 0";
+    if(scope) {
+        sql_buffer += q.where.size() ? " AND " : " WHERE ";
+        sql_buffer += *scope;
     }
 
-    if(m_group.size()) {
-        sql_buffer += " GROUP BY " + m_group;
+    if(q.group.size()) {
+        sql_buffer += " GROUP BY " + q.group;
     }
 
-    if(m_order.size()) {
-        sql_buffer += " ORDER BY " + m_order;
+    if(q.order.size()) {
+        sql_buffer += " ORDER BY " + q.order;
     }
 
-    if(m_limit.size()) {
-        sql_buffer += " LIMIT " + m_limit;
+    if(q.limit.size()) {
+        sql_buffer += " LIMIT " + q.limit;
     }
 
-    if(m_insert.size()) {
+    if(q.insert.size()) {
         sql_buffer += " INSERT INTO ";
-        sql_buffer += m_into || m_from || m_table->m_name;
+        sql_buffer += q.into || q.from || q.target->m_name;
 
-        if(m_columns.size())
+        if(q.columns.size())
         {
             sql_buffer += "(";
 
-            sql_buffer += uva::string::join(m_columns, ',');
+            sql_buffer += uva::string::join(q.columns, ',');
 
             sql_buffer += ")";
         }
 
         sql_buffer += " VALUES ";
 
-        for(size_t i = 0; i < m_insert.size(); ++i)
+        for(size_t i = 0; i < q.insert.size(); ++i)
         {
             sql_buffer.push_back('(');
 
-            for(size_t x = 0; x < m_insert[i].size(); ++x)
+            for(size_t x = 0; x < q.insert[i].size(); ++x)
             {
-                if(m_insert[i][x].type == var::var_type::null_type) {
+                if(q.insert[i][x].type == var::var_type::null_type) {
                     sql_buffer += "null";
                 }
-                else if(m_insert[i][x].type == var::var_type::string)
+                else if(q.insert[i][x].type == var::var_type::string)
                 {
                     sql_buffer.push_back('\'');
-                        m_insert[i][x].each([](const char& c) {
+                        q.insert[i][x].each([](const char& c) {
                             sql_buffer.push_back(c);
                             if(c == '\'')
                             {
@@ -1158,10 +3815,10 @@ std::string uva::database::active_record_relation::commit_sql() const
                         });
                     sql_buffer.push_back('\'');
                 } else {
-                    sql_buffer += m_insert[i][x].to_s();
+                    sql_buffer += q.insert[i][x].to_s();
                 }
 
-                if(x < m_insert[i].size()-1)
+                if(x < q.insert[i].size()-1)
                 {
                     sql_buffer.push_back(',');
                 }
@@ -1169,17 +3826,17 @@ std::string uva::database::active_record_relation::commit_sql() const
 
             sql_buffer.push_back(')');
 
-            if(i < m_insert.size()-1)
+            if(i < q.insert.size()-1)
             {
                 sql_buffer.push_back(',');
             }
         }
     }
 
-    if(m_returning.size())
+    if(q.returning.size())
     {
         sql_buffer += " RETURNING ";
-        sql_buffer += m_returning;
+        sql_buffer += q.returning;
     }
 
     sql_buffer += ";";
@@ -1196,7 +3853,9 @@ std::string uva::database::active_record_relation::commit_sql() const
 
 void uva::database::active_record_relation::commit()
 {
+    stage_timer build_timer(profiler_stage::build);
     std::string sql = commit_sql();
+    build_timer.stop();
 
     commit(sql);
 }
@@ -1217,19 +3876,16 @@ std::string uva::database::active_record_relation::to_sql() const
 
 void uva::database::active_record_relation::commit_without_prepare(const std::string& sql)
 {
-    m_columnsNames.clear();
-    m_columnsIndexes.clear();
-
     sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
 
     char* error_msg = nullptr;
     struct callback_data {
         bool firstCalback = true;
-        uva::database::active_record_relation* me;
+        result_set* result;
     };
 
     callback_data data;
-    data.me = this;
+    data.result = &reset_result();
 
     int error = 0;
     auto elapsed = uva::diagnostics::measure_function([&]
@@ -1244,17 +3900,15 @@ void uva::database::active_record_relation::commit_without_prepare(const std::st
             if(data->firstCalback) {
                 std::string colName = columnNames[i];
                 
-                data->me->m_columnsNames.push_back(colName);
-                data->me->m_columnsIndexes.insert({colName, i});
-
-                data->me->m_columnsTypes.push_back(var::var_type::string);
+                data->result->columns_names.push_back(colName);
+                data->result->columns_types.push_back(var::var_type::string);
             }
         
             data->firstCalback = false;
             cols.push_back(columnValue[i]);
         }
 
-        data->me->m_results.push_back(cols);
+        data->result->rows.push_back(std::move(cols));
 
         return 0;
     }, &data, &error_msg);});
@@ -1265,31 +3919,58 @@ void uva::database::active_record_relation::commit_without_prepare(const std::st
         sqlite3_free(error_msg);
     }
 
-    uva::console::color_code color_code;
+    report_query(sql, elapsed, error_report, data.result->rows.size());
+}
 
-    if(error_report.empty()) {
-        color_code = uva::console::color_code::blue;
-    } else {
-        color_code = uva::console::color_code::red;
-    }
+void uva::database::active_record_relation::each_row(std::function<void(const row_view&)> func)
+{
+    stage_timer build_timer(profiler_stage::build);
+    std::string sql = commit_sql();
+    build_timer.stop();
 
-    if(enable_query_cout_printing)
-    {
-        #ifdef USE_FMT_FORMT
-            std::string result = std::format("({} ms) {}", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), sql.size() > 1000 ? sql.substr(0, 1000) : sql);
-        #else
-            std::string result = std::format("({}) {}", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed), sql.size() > 1000 ? sql.substr(0, 1000) : sql);
-        #endif
+    std::string error_report;
+    size_t rows = 0;
+    m_status = statement_status();
 
-        std::cout << uva::console::color(color_code) << result << std::endl;
-    }
+    sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+    std::unique_ptr<sqlite3_connection::prepared_statement> statement;
 
-    if(!error_report.empty()) {
-        if(enable_query_cout_printing) {
-            std::cout << uva::console::color(uva::console::color_code::red) << error_report << std::endl;
+    auto elapsed = uva::diagnostics::measure_function([&] {
+
+        stage_timer prepare_timer(profiler_stage::prepare);
+        statement = connection->acquire_statement(sql);
+        prepare_timer.stop();
+
+        if(!statement) {
+            error_report = sqlite3_errmsg(connection->get_database());
+            return;
         }
-        throw std::runtime_error(error_report);
-    }
+
+        row_view row(statement->stmt, statement->columns_names);
+
+        int step = 0;
+
+        try {
+            while ((step = sqlite3_step(statement->stmt)) == SQLITE_ROW) {
+                func(row);
+                ++rows;
+            }
+        } catch(...) {
+            m_status = read_statement_status(statement->stmt);
+            connection->release_statement(sql, std::move(statement));
+            throw;
+        }
+
+        if(step != SQLITE_DONE) {
+            error_report = sqlite3_errmsg(connection->get_database());
+        }
+
+        m_status = read_statement_status(statement->stmt);
+    });
+
+    connection->release_statement(sql, std::move(statement));
+
+    report_query(sql, elapsed, error_report, rows, m_status);
 }
 
 uva::database::active_record_relation::operator uva::core::var()
@@ -1299,11 +3980,11 @@ uva::database::active_record_relation::operator uva::core::var()
     uva::database::active_record_relation rel = *this;
     rel.commit();
 
-    for(auto& value : rel.m_results)
+    for(auto& value : rel.m_result->rows)
     {
         int col_it = 0;
         std::map<var, var> row;
-        for(const std::string& col : rel.m_columnsNames) {
+        for(const std::string& col : rel.m_result->columns_names) {
             row.insert({col,std::move(value[col_it])});
             col_it++;
         }
@@ -1315,151 +3996,67 @@ uva::database::active_record_relation::operator uva::core::var()
 
 void uva::database::active_record_relation::commit(const std::string& sql)
 {
-    m_columnsNames.clear();
-    m_columnsIndexes.clear();
+    result_set& result = reset_result();
 
     std::string error_report;
+    m_status = statement_status();
 
-    sqlite3_stmt* stmt;
-    int error = 0;
-    char* error_msg = nullptr;
+    sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
+    std::unique_ptr<sqlite3_connection::prepared_statement> statement;
 
     auto elapsed = uva::diagnostics::measure_function([&] {
 
-        sqlite3_connection* connection = (sqlite3_connection*)uva::database::basic_connection::get_connection();
-
-        error = sqlite3_prepare_v2(connection->get_database(), sql.c_str(), (int)sql.size(), &stmt, nullptr);
+        stage_timer prepare_timer(profiler_stage::prepare);
+        statement = connection->acquire_statement(sql);
+        prepare_timer.stop();
 
-
-        if(error) {
-            error_msg = (char*)sqlite3_errmsg(connection->get_database());
-        }
- 
-        if(error) {
-            error_report = error_msg;
+        if(!statement) {
+            error_report = sqlite3_errmsg(connection->get_database());
             return;
         }
 
-        std::vector<var::var_type> columns_types;
-
-        size_t colCount = sqlite3_column_count(stmt);
+        sqlite3_stmt* stmt = statement->stmt;
 
-        for (int colIndex = 0; colIndex < colCount; colIndex++) {        
+        result.columns_names = statement->columns_names;
+        result.columns_types = statement->columns_types;
 
-            std::string name = sqlite3_column_name(stmt, colIndex);
-            m_columnsNames.push_back(name);
+        const column_decoder* decoders = statement->decoders.data();
+        const int colCount = (int)statement->decoders.size();
 
-            const char* type_c_str = sqlite3_column_decltype(stmt, colIndex);
+        int step = 0;
 
-            //Assume text for any unknown type
-            if(!type_c_str) {
-                type_c_str = "TEXT";
-            }
-
-            std::string type_str = type_c_str;
-
-            columns_types.push_back(sql_delctype_to_value_type(type_str));
-        }
+        stage_timer step_timer(profiler_stage::step);
+        stage_timer decode_timer(profiler_stage::decode, false);
 
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
+        while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+            step_timer.stop();
+            decode_timer.start();
 
             std::vector<var> cols;
+            cols.reserve(colCount);
 
             for (int colIndex = 0; colIndex < colCount; colIndex++) {
-
-                var holder;
-
-                size_t type = sqlite3_column_type(stmt, colIndex);
-                var::var_type& value_type = columns_types[colIndex];
-
-                if(type == SQLITE_NULL)
-                {
-                    holder = null;
-                }
-                else
-                {
-                    switch (value_type)
-                    {
-                        case var::var_type::integer:
-                        {
-                            int64_t value = sqlite3_column_int64(stmt, colIndex);
-                            holder = value;
-
-                            break;
-                        }
-                        case var::var_type::real:
-                        {
-                            double value = sqlite3_column_double(stmt, colIndex);
-                            holder = value;
-
-                            break;
-                        }
-                        case var::var_type::string:
-                        {
-                            const unsigned char* value = sqlite3_column_text(stmt, colIndex);
-
-                            if(!value) {
-                                throw std::runtime_error("attempting to read null string");
-                            }
-
-                            holder = value;
-
-                            break;
-                        }
-                        default:
-                            throw std::runtime_error("reading SQL results invalid data type");
-                        break;
-                    }
-
-                }
-
-                cols.push_back(std::move(holder));
-                #ifdef UVA_DEBUG_LEVEL > 1
-                    if(cols.back().type != value_type)
-                    {
-                        throw std::runtime_error("reading SQL results wrong data type");
-                    }
-                #endif
+                decoders[colIndex](stmt, colIndex, cols);
             }
 
-            m_results.push_back(std::move(cols));
-        }
-    });
-
-    error = sqlite3_finalize(stmt);
+            result.rows.push_back(std::move(cols));
 
-    if (error) {
-        //std::string error_report = error_msg;
-        //sqlite3_free(error_msg);
-        //throw std::runtime_error(""/*error_report*/);
-    }    
+            decode_timer.stop();
+            step_timer.start();
+        }
 
-    uva::console::color_code color_code;
+        step_timer.stop();
 
-    if(error_report.empty()) {
-        color_code = uva::console::color_code::blue;
-    } else {
-        color_code = uva::console::color_code::red;
-    }
+        if(step != SQLITE_DONE) {
+            error_report = sqlite3_errmsg(connection->get_database());
+        }
 
-    if(enable_query_cout_printing)
-    {
-        #ifdef USE_FMT_FORMT
-            std::string result = std::format("({} ms) {}", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), sql.size() > 1000 ? sql.substr(0, 1000) : sql);
-        #else
-            std::string result = std::format("({}) {}", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed), sql.size() > 1000 ? sql.substr(0, 1000) : sql);
-        #endif
+        m_status = read_statement_status(stmt);
+    });
 
-        std::cout << uva::console::color(color_code) << result << std::endl;
-    }
+    connection->release_statement(sql, std::move(statement));
 
-    if(!error_report.empty()) {
-        if(enable_query_cout_printing)
-        {
-            std::cout << uva::console::color(uva::console::color_code::red) << error_report << std::endl;
-        }
-        throw std::runtime_error(error_report);
-    }
+    report_query(sql, elapsed, error_report, result.rows.size(), m_status);
 }
 
 //ACTIVE RECORD RELATION
@@ -1521,9 +4118,13 @@ bool uva::database::basic_migration::is_pending() {
 void uva::database::basic_migration::call_change()
 {
     try {
+        // The migration and its bookkeeping row are applied together or not at all. For the same reason,
+        // alter_table refuses online rebuilds here.
         auto elapsed = uva::diagnostics::measure_function([&](){
-            this->change();
-            this->apply();
+            within_transaction([&](){
+                this->change();
+                this->apply();
+            });
         });
 
         #ifdef USE_FMT_FORMT
@@ -1562,24 +4163,150 @@ void uva::database::basic_migration::do_pending_migrations()
         return lhs->date_str < rhs->date_str;
     });
 
+    // The registry is shared by every connection, a new database (e.g. a template) may not have the table yet.
+    uva::database::basic_connection::get_connection()->create_table(uva::database::basic_migration::table());
+
+    // One query for every applied migration instead of one is_pending() per migration.
+    std::unordered_set<std::string> applied;
+
+    for(const var& title : uva::database::basic_migration::all().pluck("title")) {
+        applied.insert(title.to_s());
+    }
+
+    bool changed = false;
+
     for(uva::database::basic_migration* migration : migrations)
     {
-        if(migration->is_pending()) {
+        if(!applied.contains(migration->title)) {
             migration->call_change();
+            changed = true;
+        }
+    }
+
+    // Raw statements in change() (add_index, drop_table...) are not tracked, so the whole schema is read again.
+    if(changed) {
+        uva::database::basic_connection::get_connection()->load_schema();
+    }
+}
+
+// sqlite_schema keeps "CREATE TABLE name", "CREATE UNIQUE INDEX name"... without IF NOT EXISTS.
+static std::string create_if_not_exists(const std::string& type, std::string sql)
+{
+    std::string upper_type = type;
+    std::transform(upper_type.begin(), upper_type.end(), upper_type.begin(), ::toupper);
+
+    size_t position = sql.find(upper_type);
+
+    if(position != std::string::npos) {
+        sql.insert(position + upper_type.size(), " IF NOT EXISTS");
+    }
+
+    return sql;
+}
+
+void uva::database::basic_migration::dump_schema(const std::filesystem::path& path)
+{
+    sqlite3* database = ((sqlite3_connection*)uva::database::basic_connection::get_connection())->get_database();
+
+    std::ofstream file(path);
+
+    if(!file.is_open()) {
+        throw std::runtime_error(std::format("unable to open {} to dump the schema", path.string()));
+    }
+
+    file << "-- Generated by basic_migration::dump_schema. Load it with basic_migration::load_schema_snapshot.\n\n";
+
+    // rowid keeps the creation order, views may depend on other views.
+    for_each_schema_row(database,
+        "SELECT type, sql FROM sqlite_schema WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite_%' "
+        "ORDER BY CASE type WHEN 'table' THEN 0 WHEN 'index' THEN 1 WHEN 'view' THEN 2 ELSE 3 END, rowid;", "", [&](sqlite3_stmt* stmt) {
+        file << create_if_not_exists(column_text(stmt, 0), column_text(stmt, 1)) << ";\n\n";
+    });
+
+    for(const var& title : basic_migration::all().order_by("id").pluck("title")) {
+        std::string escaped;
+
+        for(const char& c : title.to_s()) {
+            if(c == '\'') {
+                escaped.push_back('\'');
+            }
+            escaped.push_back(c);
+        }
+
+        file << std::format("INSERT INTO database_migrations(title) SELECT '{0}' WHERE NOT EXISTS (SELECT 1 FROM database_migrations WHERE title = '{0}');\n", escaped);
+    }
+}
+
+void uva::database::basic_migration::load_schema_snapshot(const std::filesystem::path& path)
+{
+    std::ifstream file(path);
+
+    if(!file.is_open()) {
+        throw std::runtime_error(std::format("unable to open schema snapshot {}", path.string()));
+    }
+
+    std::string sql((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    uva::database::basic_connection* connection = uva::database::basic_connection::get_connection();
+    sqlite3* database = ((sqlite3_connection*)connection)->get_database();
+
+    auto elapsed = uva::diagnostics::measure_function([&](){
+        execute_schema_sql(database, "BEGIN TRANSACTION;");
+
+        try {
+            execute_schema_sql(database, sql);
+        } catch(...) {
+            execute_schema_sql(database, "ROLLBACK;");
+            throw;
         }
+
+        execute_schema_sql(database, "COMMIT;");
+    });
+
+    #ifdef USE_FMT_FORMT
+        std::cout << uva::console::color(uva::console::color_code::green) << std::format("{}: {} ms...", path.filename().string(), std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()) << std::endl;
+    #else
+        std::cout << uva::console::color(uva::console::color_code::green) << std::format("{}: {}...", path.filename().string(), std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)) << std::endl;
+    #endif
+
+    connection->load_schema();
+}
+
+void uva::database::basic_migration::bootstrap(const std::filesystem::path& schema)
+{
+    sqlite3* database = ((sqlite3_connection*)uva::database::basic_connection::get_connection())->get_database();
+
+    size_t tables = 0;
+
+    for_each_schema_row(database, "SELECT COUNT(*) FROM sqlite_schema WHERE type = 'table' AND name NOT LIKE 'sqlite_%' AND name <> 'database_migrations';", "", [&](sqlite3_stmt* stmt) {
+        tables = (size_t)sqlite3_column_int64(stmt, 0);
+    });
+
+    if(!tables && std::filesystem::exists(schema)) {
+        load_schema_snapshot(schema);
     }
+
+    do_pending_migrations();
 }
 
 void uva::database::basic_migration::apply()
 {
+    // Always a new row, the migration may have been applied to another database before.
+    values.erase("id");
     at("title") = title;
     save();
 }
 
-void uva::database::basic_migration::add_table(const std::string& table_name, const std::vector<std::pair<std::string, std::string>>& cols)
+void uva::database::basic_migration::add_table(const std::string& table_name, const std::vector<std::pair<std::string, std::string>>& cols, const table_options& options)
 {
-    uva::database::table* new_table = new uva::database::table(table_name, cols);
-    uva::database::basic_connection::get_connection()->create_table(new_table);
+    uva::database::table* table = uva::database::table::get_table(table_name);
+    table->m_columns = cols;
+    table->m_constraints.clear();
+    table->m_without_rowid = options.without_rowid;
+    table->m_strict = options.strict;
+    table->primary_key = uva::string::join(options.primary_key, ',');
+    uva::database::basic_connection::get_connection()->create_table(table);
+    uva::database::basic_connection::get_connection()->read_schema(table);
 }
 
 void uva::database::basic_migration::drop_table(const std::string& table_name)
@@ -1589,7 +4316,52 @@ void uva::database::basic_migration::drop_table(const std::string& table_name)
 
 void uva::database::basic_migration::add_index(const std::string& table_name, const std::string& column)
 {
-    uva::database::active_record_relation().commit_without_prepare(std::format("CREATE INDEX IF NOT EXISTS idx_{}_on_{} ON {}({});", table_name, uva::string::replace(column, ',', '_'), table_name, column));
+    add_index(table_name, column, index_options());
+}
+
+void uva::database::basic_migration::add_index(const std::string& table_name, const std::string& columns, const index_options& options)
+{
+    uva::database::table* table = uva::database::table::get_table(table_name);
+
+    std::string key = columns;
+
+    for(const std::string& column : options.include) {
+        key += ", " + column;
+    }
+
+    std::string where = options.where;
+
+    if(options.scope == index_scope::default_scope) {
+        if(table->m_default_scope.empty()) {
+            throw std::runtime_error(std::format("cannot scope index on {}: the table has no default scope", table_name));
+        }
+
+        where = where.empty() ? table->m_default_scope : "(" + where + ") AND " + table->m_default_scope;
+    }
+
+    std::string name = options.name;
+
+    // Expressions become valid identifiers: "code, lower(name)" -> idx_t_on_code_lower_name.
+    if(name.empty()) {
+        name = "idx_" + table_name + "_on_";
+
+        for(const char& c : key) {
+            if(isalnum((unsigned char)c)) {
+                name.push_back(c);
+            } else if(name.back() != '_') {
+                name.push_back('_');
+            }
+        }
+
+        while(name.back() == '_') {
+            name.pop_back();
+        }
+    }
+
+    uva::database::active_record_relation().commit_without_prepare(std::format("CREATE {}INDEX IF NOT EXISTS {} ON {}({}){};",
+        options.unique ? "UNIQUE " : "", name, table_name, key, where.size() ? " WHERE " + where : ""));
+
+    uva::database::basic_connection::get_connection()->read_schema(table);
 }
 
 void uva::database::basic_migration::add_column(const std::string& table_name, const std::string& name, const std::string& type, const std::string& default_value) const